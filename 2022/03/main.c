@@ -2,8 +2,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <pthread.h>
 
-#define MAX_LINE_LENGTH 256
+#define READ_CHUNK_SIZE 65536
+#define GROUP_SIZE 3
 
 typedef struct Luggage_t *Luggage;
 
@@ -29,51 +31,83 @@ void Luggage_destroy(Luggage *luggage)
 	free(*luggage);
 }
 
+/*
+ * The file is streamed in chunks of READ_CHUNK_SIZE bytes. Every chunk is
+ * scanned for '\n' with memchr and the bytes in between are appended to the
+ * items buffer directly, so a rucksack line can be of any length. Both the
+ * items buffer and rucksack_item_ptr grow geometrically.
+ */
 void Luggage_read_from_file(const char *filename, Luggage luggage)
 {
 	FILE *fp = NULL;
-	char buf[MAX_LINE_LENGTH];
-	size_t len;
-	int start, r;
+	char buf[READ_CHUNK_SIZE];
+	size_t nread, len, items_capacity, ptr_capacity;
+	int items, line_open;
+	char *ch, *end, *nl;
 
 	fp = fopen(filename, "r");
 	if (fp == NULL)
 		fprintf(stderr, "Failed to open %s\n", filename);
 	else
 	{
+		ptr_capacity = 1024;
+		items_capacity = READ_CHUNK_SIZE;
+		luggage->rucksack_item_ptr = (int*) malloc( ptr_capacity * sizeof(int) );
+		luggage->items = (char*)malloc( items_capacity * sizeof(char) );
+
 		luggage->rucksacks = 0;
-		while(fgets(buf, MAX_LINE_LENGTH, fp) != NULL)
-			luggage->rucksacks++;
+		luggage->rucksack_item_ptr[0] = 0;
+		items = 0;
+		line_open = 0;
+		while ((nread = fread(buf, sizeof(char), READ_CHUNK_SIZE, fp)) > 0)
+		{
+			ch = buf;
+			end = buf + nread;
+			while (ch < end)
+			{
+				nl = (char*)memchr(ch, '\n', end - ch);
+				len = (nl != NULL ? nl : end) - ch;
 
-		printf("Number of rucksacks: %d\n", luggage->rucksacks);
+				if (items + len > items_capacity)
+				{
+					while (items + len > items_capacity)
+						items_capacity *= 2;
+					luggage->items = (char*)realloc( luggage->items, items_capacity * sizeof(char) );
+				}
+				memcpy(&luggage->items[items], ch, len);
+				items += len;
+				line_open = 1;
 
-		luggage->rucksack_item_ptr = (int*) malloc( (luggage->rucksacks+1) * sizeof(int) );
+				if (nl == NULL)
+					break;
 
-		rewind(fp);
+				// End of rucksack
+				if (luggage->rucksacks + 2 > ptr_capacity)
+				{
+					ptr_capacity *= 2;
+					luggage->rucksack_item_ptr = (int*)realloc( luggage->rucksack_item_ptr, ptr_capacity * sizeof(int) );
+				}
+				luggage->rucksacks++;
+				luggage->rucksack_item_ptr[luggage->rucksacks] = items;
+				line_open = 0;
+				ch = nl + 1;
+			}
+		}
 
-		r = 0;
-		luggage->rucksack_item_ptr[0] = 0;
-		while(fgets(buf, MAX_LINE_LENGTH, fp) != NULL)
+		// Last line without a trailing newline
+		if (line_open && items > luggage->rucksack_item_ptr[luggage->rucksacks])
 		{
-			len = strlen(buf)-1;
-			luggage->rucksack_item_ptr[r+1] = luggage->rucksack_item_ptr[r] + len;
-			r++;
+			if (luggage->rucksacks + 2 > ptr_capacity)
+			{
+				ptr_capacity *= 2;
+				luggage->rucksack_item_ptr = (int*)realloc( luggage->rucksack_item_ptr, ptr_capacity * sizeof(int) );
+			}
+			luggage->rucksacks++;
+			luggage->rucksack_item_ptr[luggage->rucksacks] = items;
 		}
 
+		printf("Number of rucksacks: %d\n", luggage->rucksacks);
 		printf("Number of items: %d\n", luggage->rucksack_item_ptr[luggage->rucksacks]);
-
-		luggage->items = (char*)malloc( luggage->rucksack_item_ptr[luggage->rucksacks] * sizeof(char) );
-		
-		rewind(fp);
-
-		r = 0;
-		while(fgets(buf, MAX_LINE_LENGTH, fp) != NULL)
-		{
-			start = luggage->rucksack_item_ptr[r];
-			len = luggage->rucksack_item_ptr[r+1] - start;
-			strncpy(&luggage->items[start], buf, len);
-			r++;
-		}
 	
 		fclose(fp);
 	}
@@ -135,20 +169,20 @@ int Luggage_sum_priority_wrong_items(Luggage luggage)
 char Group_identify_badge(const int group, const Luggage luggage)
 {
 	unsigned int i, j, r;
-	unsigned int flag[3];
+	unsigned int flag[GROUP_SIZE];
 	char badge;
 
 	// Pick item from first rucksack to search in the other rucksacks
-	for (i = luggage->rucksack_item_ptr[group*3+0]; i < luggage->rucksack_item_ptr[group*3+1]; ++i)
+	for (i = luggage->rucksack_item_ptr[group*GROUP_SIZE+0]; i < luggage->rucksack_item_ptr[group*GROUP_SIZE+1]; ++i)
 	{
 		badge = luggage->items[i];
 		flag[0] = 1;
 
 		// Search the other rucksacks of the group
-		for (r = 1; r < 3; ++r)
+		for (r = 1; r < GROUP_SIZE; ++r)
 		{
 			flag[r] = 0;
-			for (j = luggage->rucksack_item_ptr[group*3+r]; j < luggage->rucksack_item_ptr[group*3+r+1]; ++j)
+			for (j = luggage->rucksack_item_ptr[group*GROUP_SIZE+r]; j < luggage->rucksack_item_ptr[group*GROUP_SIZE+r+1]; ++j)
 			{
 				if (luggage->items[j] == badge)
 				{
@@ -160,7 +194,7 @@ char Group_identify_badge(const int group, const Luggage luggage)
 
 		// Flag flag[0] == 1 if and only if all groups contain the badge. 
 		// That is, flag[0] <- flag[0] * falg[1] * flag[2].
-		for (r = 1; r < 3; ++r)
+		for (r = 1; r < GROUP_SIZE; ++r)
 			flag[0] *= flag[r];
 
 		if (flag[0]) return badge;
@@ -173,14 +207,14 @@ int Luggage_sum_priority_group_badges(const Luggage luggage)
 	int sum, g;
 	char group_badge;
 	
-	if (luggage->rucksacks % 3 != 0) 	
+	if (luggage->rucksacks % GROUP_SIZE != 0) 	
 	{
 		perror("Number of rucksacks is not a multiple of 3.\n");
 		return -1;
 	}
 
 	sum = 0;
-	for (g = 0; g < (int)(luggage->rucksacks/3); ++g)
+	for (g = 0; g < (int)(luggage->rucksacks/GROUP_SIZE); ++g)
 	{
 		group_badge = Group_identify_badge(g, luggage);
 		sum +=  Item_priority(&group_badge);
@@ -188,11 +222,126 @@ int Luggage_sum_priority_group_badges(const Luggage luggage)
 	return sum;
 }
 
+/*
+ * Parallel reduction over the rucksacks. Each worker gets a contiguous range
+ * [first, last) of work units and writes its partial sum into its own slot.
+ * For part 1 a unit is a single rucksack, for part 2 a unit is a whole group
+ * of GROUP_SIZE rucksacks, so group boundaries never cross a worker range.
+ * The partial sums are added up in worker order afterwards, which keeps the
+ * result independent of the thread scheduling.
+ */
+typedef struct Luggage_work_t
+{
+	Luggage luggage;
+	int first;
+	int last;
+	int sum;
+	int joinable;
+} Luggage_work;
+
+void *Luggage_wrong_items_worker(void *arg)
+{
+	Luggage_work *work = (Luggage_work*)arg;
+	int r, start, len;
+	char item;
+
+	work->sum = 0;
+	for (r = work->first; r < work->last; ++r)
+	{
+		start = work->luggage->rucksack_item_ptr[r];
+		len = work->luggage->rucksack_item_ptr[r+1] - start;
+		item = Luggage_rucksack_wrong_item(len, &work->luggage->items[start]);
+		work->sum += Item_priority(&item);
+	}
+	return NULL;
+}
+
+void *Luggage_group_badges_worker(void *arg)
+{
+	Luggage_work *work = (Luggage_work*)arg;
+	int g;
+	char group_badge;
+
+	work->sum = 0;
+	for (g = work->first; g < work->last; ++g)
+	{
+		group_badge = Group_identify_badge(g, work->luggage);
+		work->sum += Item_priority(&group_badge);
+	}
+	return NULL;
+}
+
+int Luggage_parallel_reduce(const Luggage luggage, const int units, int threads, void *(*worker)(void*))
+{
+	pthread_t *tids;
+	Luggage_work *work;
+	int t, chunk, sum;
+
+	if (threads < 1)
+		threads = 1;
+	if (threads > units)
+		threads = units > 0 ? units : 1;
+
+	tids = (pthread_t*)malloc( threads * sizeof(pthread_t) );
+	work = (Luggage_work*)malloc( threads * sizeof(Luggage_work) );
+
+	chunk = (units + threads - 1) / threads;
+	for (t = 0; t < threads; ++t)
+	{
+		work[t].luggage = luggage;
+		work[t].first = t * chunk < units ? t * chunk : units;
+		work[t].last = work[t].first + chunk < units ? work[t].first + chunk : units;
+		work[t].sum = 0;
+		work[t].joinable = 1;
+		if (pthread_create(&tids[t], NULL, worker, &work[t]) != 0)
+		{
+			perror("Failed to create worker thread, running serially.\n");
+			worker(&work[t]);
+			work[t].joinable = 0;
+		}
+	}
+
+	sum = 0;
+	for (t = 0; t < threads; ++t)
+	{
+		if (work[t].joinable)
+			pthread_join(tids[t], NULL);
+		sum += work[t].sum;
+	}
+
+	free(work);
+	free(tids);
+
+	return sum;
+}
+
+int Luggage_sum_priority_wrong_items_parallel(const Luggage luggage, const int threads)
+{
+	return Luggage_parallel_reduce(luggage, luggage->rucksacks, threads, Luggage_wrong_items_worker);
+}
+
+int Luggage_sum_priority_group_badges_parallel(const Luggage luggage, const int threads)
+{
+	if (luggage->rucksacks % GROUP_SIZE != 0) 	
+	{
+		perror("Number of rucksacks is not a multiple of 3.\n");
+		return -1;
+	}
+
+	return Luggage_parallel_reduce(luggage, luggage->rucksacks / GROUP_SIZE, threads, Luggage_group_badges_worker);
+}
+
+/*
+ * Usage: rucksack-packing <file> [threads]
+ *
+ * Without a thread count the serial implementation is used.
+ */
 int main(int argc, char **argv)
 {
 	Luggage luggage;
 	int sum_priority_wrong_itmes;
 	int sum_priority_group_badges;
+	int threads;
 
 	Luggage_create(&luggage);
 
@@ -202,12 +351,20 @@ int main(int argc, char **argv)
 	{
 		Luggage_read_from_file(argv[1], luggage);
 
+		threads = argc > 2 ? atoi(argv[2]) : 0;
+
 		// Part 1
-		sum_priority_wrong_itmes = Luggage_sum_priority_wrong_items(luggage);
+		if (threads > 0)
+			sum_priority_wrong_itmes = Luggage_sum_priority_wrong_items_parallel(luggage, threads);
+		else
+			sum_priority_wrong_itmes = Luggage_sum_priority_wrong_items(luggage);
 		printf("The sum of the priority of wrong items: %d\n", sum_priority_wrong_itmes);	
 
 		// Part 2
-		sum_priority_group_badges = Luggage_sum_priority_group_badges(luggage);	
+		if (threads > 0)
+			sum_priority_group_badges = Luggage_sum_priority_group_badges_parallel(luggage, threads);
+		else
+			sum_priority_group_badges = Luggage_sum_priority_group_badges(luggage);	
 		printf("The sum of the priority of group badges: %d\n", sum_priority_group_badges);	
 	}
 
@@ -1,14 +1,34 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <limits.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
 
 #define MAX_LINE_LENGTH 256
 
 typedef struct Campdb_p *Campdb;
 
+/*
+ * The section ranges are stored as structure of arrays. For pair p the first
+ * elf is assigned to [s0[p], e0[p]] and the second elf to [s1[p], e1[p]].
+ *
+ * The columns use the narrowest unsigned type that holds the largest section
+ * ID of the file: width is 1 (unsigned char), 2 (unsigned short) or 4
+ * (unsigned int) bytes per entry. Use Campdb_get() for element access
+ * outside of the counting kernels.
+ */
 struct Campdb_p
 {
 	unsigned int pairs;
-	unsigned int *section_ranges;
+	unsigned int width;
+	void *s0;
+	void *e0;
+	void *s1;
+	void *e1;
 };
 
 void Campdb_create(Campdb *cdb)
@@ -17,151 +37,760 @@ void Campdb_create(Campdb *cdb)
 	(*cdb) = (struct Campdb_p*)malloc( sizeof(struct Campdb_p) );
 	if (*cdb == NULL)
 		perror("Failed to create Campdb");
+	else
+	{
+		(*cdb)->pairs = 0;
+		(*cdb)->width = sizeof(unsigned int);
+		(*cdb)->s0 = NULL;
+		(*cdb)->e0 = NULL;
+		(*cdb)->s1 = NULL;
+		(*cdb)->e1 = NULL;
+	}
 }
 
 void Campdb_destroy(Campdb *cdb)
 {
-	free((*cdb)->section_ranges);
+	free((*cdb)->s0);
+	free((*cdb)->e0);
+	free((*cdb)->s1);
+	free((*cdb)->e1);
 	free(*cdb);
 }
 
+unsigned int Campdb_get(const void *column, const unsigned int width, const unsigned int p)
+{
+	switch (width)
+	{
+		case sizeof(unsigned char):
+			return ((const unsigned char*)column)[p];
+		case sizeof(unsigned short):
+			return ((const unsigned short*)column)[p];
+		default:
+			return ((const unsigned int*)column)[p];
+	}
+}
+
+void Campdb_set(void *column, const unsigned int width, const unsigned int p, const unsigned int value)
+{
+	switch (width)
+	{
+		case sizeof(unsigned char):
+			((unsigned char*)column)[p] = (unsigned char)value;
+			break;
+		case sizeof(unsigned short):
+			((unsigned short*)column)[p] = (unsigned short)value;
+			break;
+		default:
+			((unsigned int*)column)[p] = value;
+	}
+}
+
+/*
+ * Lines that do not hold two section ranges (blank or malformed lines) are
+ * skipped in both passes, as in Campdb_count_ranges_from_file().
+ */
 void Campdb_read_from_file(const char *filename, Campdb cdb)
 {
 	FILE *fp = NULL;
 	char buf[MAX_LINE_LENGTH];
-	unsigned int p;
-	unsigned int *ranges;
+	unsigned int p, r[4], max_section;
 
 	fp = fopen(filename, "r");
 	if (fp == NULL)
-		fprintf(stderr, "Failed to open file %d\n", filename);
+		fprintf(stderr, "Failed to open file %s\n", filename);
 	else
 	{
+		// The first pass counts the pairs and finds the largest section ID
+		// to pick the column width.
 		cdb->pairs = 0;
+		max_section = 0;
 		while(fgets(buf, MAX_LINE_LENGTH, fp) != NULL)
+		{
+			if (sscanf(buf, "%u-%u,%u-%u", &r[0], &r[1], &r[2], &r[3]) != 4)
+				continue;
+			for (p = 0; p < 4; ++p)
+				if (r[p] > max_section)
+					max_section = r[p];
 			cdb->pairs++;
-	
-		printf("%d pairs found\n", cdb->pairs);	
+		}
+
+		if (max_section <= UCHAR_MAX)
+			cdb->width = sizeof(unsigned char);
+		else if (max_section <= USHRT_MAX)
+			cdb->width = sizeof(unsigned short);
+		else
+			cdb->width = sizeof(unsigned int);
 
-		cdb->section_ranges = NULL;
-		cdb->section_ranges = (unsigned int*)malloc( cdb->pairs * 4 * sizeof(unsigned int) );
+		printf("%d pairs found\n", cdb->pairs);
+		printf("Section ID width: %u byte\n", cdb->width);
+
+		cdb->s0 = malloc( cdb->pairs * cdb->width );
+		cdb->e0 = malloc( cdb->pairs * cdb->width );
+		cdb->s1 = malloc( cdb->pairs * cdb->width );
+		cdb->e1 = malloc( cdb->pairs * cdb->width );
 
 		rewind(fp);
 
 		p = 0;
-		while(fgets(buf, MAX_LINE_LENGTH, fp) != NULL)
+		while(fgets(buf, MAX_LINE_LENGTH, fp) != NULL && p < cdb->pairs)
 		{
-			ranges = &cdb->section_ranges[p*4];
-			sscanf(buf, "%d-%d,%d-%d", &ranges[0], &ranges[1], &ranges[2], &ranges[3]);
+			if (sscanf(buf, "%u-%u,%u-%u", &r[0], &r[1], &r[2], &r[3]) != 4)
+				continue;
+			Campdb_set(cdb->s0, cdb->width, p, r[0]);
+			Campdb_set(cdb->e0, cdb->width, p, r[1]);
+			Campdb_set(cdb->s1, cdb->width, p, r[2]);
+			Campdb_set(cdb->e1, cdb->width, p, r[3]);
 			p++;
 		}
+
+		fclose(fp);
 	}
-	fclose(fp);
+}
+
+/*
+ * Optional validation pass. Reports every pair where one of the ranges is
+ * not a valid interval, i.e. where the start is larger than the end. The
+ * counting kernels below do not print anything and simply do not count
+ * invalid pairs.
+ *
+ * Return: The number of invalid pairs.
+ */
+unsigned int Campdb_validate(const Campdb cdb)
+{
+	unsigned int p, invalid, s0, e0, s1, e1;
+
+	invalid = 0;
+	for (p = 0; p < cdb->pairs; ++p)
+	{
+		s0 = Campdb_get(cdb->s0, cdb->width, p);
+		e0 = Campdb_get(cdb->e0, cdb->width, p);
+		s1 = Campdb_get(cdb->s1, cdb->width, p);
+		e1 = Campdb_get(cdb->e1, cdb->width, p);
+		if (s0 > e0 || s1 > e1)
+		{
+			fprintf(stderr, "Error in Campdb_validate(): No valid input in pair %u: I0 = [%u, %u] and I1 = [%u, %u]\n",
+				p, s0, e0, s1, e1);
+			invalid++;
+		}
+	}
+	return invalid;
 }
 
 /*       |------|
  *   |-----------------|
  *  s1   s0     e0     e1
  *
- * Test if interval I0 = [s0, e0] is fully contained in I1 = [s1, e1]. This is the case if
+ * Test if interval I0 = [s0, e0] is fully contained in I1 = [s1, e1] or vice
+ * versa. This is the case if
  *
- *  s1 <= s0 <= e0 <= e1
+ *  s1 <= s0 <= e0 <= e1  or  s0 <= s1 <= e1 <= e0
  *
+ * The test is branch free and 0 is returned for invalid intervals.
  */
-unsigned int Pair_contained(const unsigned int *restrict I0, const unsigned int *restrict I1)
+unsigned int Pair_contained(const unsigned int s0, const unsigned int e0, const unsigned int s1, const unsigned int e1)
 {
-	if (I0[0] <= I0[1] && I1[0] <= I1[1])
-		if ( I1[0] <= I0[0] && I0[1] <= I1[1] ) 
-			return 1;
-		else 
-			return 0;
-	else
-		fprintf(stderr, "Error in Pair_contained(): No valid input: I0 = [%d, %d] and I1 = [%d, %d]\n", I0[0], I0[1], I1[0], I1[1]);
-	return 0;
+	return (s0 <= e0) & (s1 <= e1) & (((s1 <= s0) & (e0 <= e1)) | ((s0 <= s1) & (e1 <= e0)));
+}
+
+/*          I0      I1
+ *  |--------------|
+ *           |--------------|
+ *  s0       s1    e0       e1
+ *
+ * Test if the Intervals I0 = [s0, e0] and I1 = [s1, e1] overlap. This covers
+ * partial overlaps in both directions as well as contained intervals and is
+ * the case if
+ *
+ *   s0 <= e1  and  s1 <= e0
+ *
+ * The test is branch free and 0 is returned for invalid intervals.
+ */
+unsigned int Pair_overlap(const unsigned int s0, const unsigned int e0, const unsigned int s1, const unsigned int e1)
+{
+	return (s0 <= e0) & (s1 <= e1) & (s0 <= e1) & (s1 <= e0);
+}
+
+/*
+ * Vector primitives for the counting kernels. LE_U<n>(a, b) yields a lane
+ * mask (all bits set for true) for the unsigned test a <= b on n bit lanes.
+ * AVX2 provides unsigned max, where a <= b  <=>  max(a, b) == b. SSE2 only
+ * has an unsigned max for bytes. For wider lanes the sign bit is flipped,
+ * which maps the unsigned order onto the signed order, and a <= b is
+ * computed as !(a > b).
+ *
+ * The primitives are defined for one instruction set at a time, see the
+ * kernel instantiations below.
+ */
+#define CAMPDB_VECTOR_LOOP(T, LE) \
+	for (; p + VEC_BYTES / sizeof(T) <= pairs; p += VEC_BYTES / sizeof(T)) \
+	{ \
+		VEC vs0 = VEC_LOAD(&s0[p]); \
+		VEC ve0 = VEC_LOAD(&e0[p]); \
+		VEC vs1 = VEC_LOAD(&s1[p]); \
+		VEC ve1 = VEC_LOAD(&e1[p]); \
+		VEC valid = VEC_AND(LE(vs0, ve0), LE(vs1, ve1)); \
+		VEC c = VEC_OR(VEC_AND(LE(vs1, vs0), LE(ve0, ve1)), VEC_AND(LE(vs0, vs1), LE(ve1, ve0))); \
+		VEC o = VEC_AND(LE(vs0, ve1), LE(vs1, ve0)); \
+		bits_contained += VEC_MASK_BITS(VEC_AND(valid, c)); \
+		bits_overlap += VEC_MASK_BITS(VEC_AND(valid, o)); \
+	}
+
+/*
+ * Count the contained and the overlapping pairs in one sweep over the four
+ * columns of type T. The vector loop computes the lane masks of all
+ * comparisons without branches and counts the set lanes with movemask and
+ * popcount. Every lane contributes sizeof(T) mask bits. The narrower the
+ * type, the more pairs are tested per vector: 8/16/32 (AVX2) or 4/8/16
+ * (SSE2) for 4/2/1 byte columns. The remaining pairs, or all pairs of the
+ * scalar kernels with an empty VECTOR_LOOP, are handled by the scalar tests.
+ */
+#define CAMPDB_COUNT_KERNEL(NAME, T, VECTOR_LOOP) \
+void NAME(const void *s0_column, const void *e0_column, const void *s1_column, const void *e1_column, \
+          const unsigned int pairs, unsigned int *contained, unsigned int *overlap) \
+{ \
+	const T *restrict s0 = (const T*)s0_column; \
+	const T *restrict e0 = (const T*)e0_column; \
+	const T *restrict s1 = (const T*)s1_column; \
+	const T *restrict e1 = (const T*)e1_column; \
+	unsigned long bits_contained = 0, bits_overlap = 0; \
+	unsigned int p = 0; \
+\
+	VECTOR_LOOP \
+\
+	*contained = (unsigned int)(bits_contained / sizeof(T)); \
+	*overlap = (unsigned int)(bits_overlap / sizeof(T)); \
+	for (; p < pairs; ++p) \
+	{ \
+		*contained += Pair_contained(s0[p], e0[p], s1[p], e1[p]); \
+		*overlap += Pair_overlap(s0[p], e0[p], s1[p], e1[p]); \
+	} \
 }
 
+CAMPDB_COUNT_KERNEL(Campdb_count_ranges_u8_scalar, unsigned char, )
+CAMPDB_COUNT_KERNEL(Campdb_count_ranges_u16_scalar, unsigned short, )
+CAMPDB_COUNT_KERNEL(Campdb_count_ranges_u32_scalar, unsigned int, )
+
+#ifdef HAVE_X86_KERNELS
+#define VEC __m128i
+#define VEC_BYTES 16
+#define VEC_LOAD(ptr) _mm_loadu_si128((const __m128i*)(ptr))
+#define VEC_AND(a, b) _mm_and_si128((a), (b))
+#define VEC_OR(a, b) _mm_or_si128((a), (b))
+#define VEC_MASK_BITS(m) __builtin_popcount((unsigned int)_mm_movemask_epi8(m))
+#define LE_U8(a, b) _mm_cmpeq_epi8(_mm_max_epu8((a), (b)), (b))
+#define LE_U16(a, b) _mm_xor_si128(_mm_cmpgt_epi16(_mm_xor_si128((a), _mm_set1_epi16((short)0x8000)), \
+                                                  _mm_xor_si128((b), _mm_set1_epi16((short)0x8000))), _mm_set1_epi32(-1))
+#define LE_U32(a, b) _mm_xor_si128(_mm_cmpgt_epi32(_mm_xor_si128((a), _mm_set1_epi32((int)0x80000000u)), \
+                                                  _mm_xor_si128((b), _mm_set1_epi32((int)0x80000000u))), _mm_set1_epi32(-1))
+
+__attribute__((target("sse2")))
+CAMPDB_COUNT_KERNEL(Campdb_count_ranges_u8_sse2, unsigned char, CAMPDB_VECTOR_LOOP(unsigned char, LE_U8))
+__attribute__((target("sse2")))
+CAMPDB_COUNT_KERNEL(Campdb_count_ranges_u16_sse2, unsigned short, CAMPDB_VECTOR_LOOP(unsigned short, LE_U16))
+__attribute__((target("sse2")))
+CAMPDB_COUNT_KERNEL(Campdb_count_ranges_u32_sse2, unsigned int, CAMPDB_VECTOR_LOOP(unsigned int, LE_U32))
+
+#undef VEC
+#undef VEC_BYTES
+#undef VEC_LOAD
+#undef VEC_AND
+#undef VEC_OR
+#undef VEC_MASK_BITS
+#undef LE_U8
+#undef LE_U16
+#undef LE_U32
+
+#define VEC __m256i
+#define VEC_BYTES 32
+#define VEC_LOAD(ptr) _mm256_loadu_si256((const __m256i*)(ptr))
+#define VEC_AND(a, b) _mm256_and_si256((a), (b))
+#define VEC_OR(a, b) _mm256_or_si256((a), (b))
+#define VEC_MASK_BITS(m) __builtin_popcount((unsigned int)_mm256_movemask_epi8(m))
+#define LE_U8(a, b) _mm256_cmpeq_epi8(_mm256_max_epu8((a), (b)), (b))
+#define LE_U16(a, b) _mm256_cmpeq_epi16(_mm256_max_epu16((a), (b)), (b))
+#define LE_U32(a, b) _mm256_cmpeq_epi32(_mm256_max_epu32((a), (b)), (b))
 
-unsigned int Campdb_sum_contained_ranges(const Campdb cdb)
+__attribute__((target("avx2")))
+CAMPDB_COUNT_KERNEL(Campdb_count_ranges_u8_avx2, unsigned char, CAMPDB_VECTOR_LOOP(unsigned char, LE_U8))
+__attribute__((target("avx2")))
+CAMPDB_COUNT_KERNEL(Campdb_count_ranges_u16_avx2, unsigned short, CAMPDB_VECTOR_LOOP(unsigned short, LE_U16))
+__attribute__((target("avx2")))
+CAMPDB_COUNT_KERNEL(Campdb_count_ranges_u32_avx2, unsigned int, CAMPDB_VECTOR_LOOP(unsigned int, LE_U32))
+#endif
+
+typedef void (*Campdb_count_kernel)(const void*, const void*, const void*, const void*,
+                                    const unsigned int, unsigned int*, unsigned int*);
+
+/*
+ * Pick the widest kernel the CPU supports at runtime for columns of the
+ * given width.
+ */
+Campdb_count_kernel Campdb_select_kernel(const unsigned int width)
 {
-	unsigned int sum, p, *ranges;
+#ifdef HAVE_X86_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return width == sizeof(unsigned char) ? Campdb_count_ranges_u8_avx2
+		     : width == sizeof(unsigned short) ? Campdb_count_ranges_u16_avx2
+		     : Campdb_count_ranges_u32_avx2;
+	if (__builtin_cpu_supports("sse2"))
+		return width == sizeof(unsigned char) ? Campdb_count_ranges_u8_sse2
+		     : width == sizeof(unsigned short) ? Campdb_count_ranges_u16_sse2
+		     : Campdb_count_ranges_u32_sse2;
+#endif
+	return width == sizeof(unsigned char) ? Campdb_count_ranges_u8_scalar
+	     : width == sizeof(unsigned short) ? Campdb_count_ranges_u16_scalar
+	     : Campdb_count_ranges_u32_scalar;
+}
 
-	sum = 0;
-	for (p = 0; p < cdb->pairs; ++p)
+void Campdb_count_ranges(const Campdb cdb, unsigned int *contained, unsigned int *overlap)
+{
+	Campdb_select_kernel(cdb->width)(cdb->s0, cdb->e0, cdb->s1, cdb->e1, cdb->pairs, contained, overlap);
+}
+
+/*
+ * Streaming variant of Campdb_count_ranges(). Each line is classified right
+ * after it has been parsed, so the section ranges are never stored and the
+ * memory footprint does not depend on the number of pairs.
+ *
+ * Return: The number of pairs read or -1 if the file cannot be opened.
+ */
+int Campdb_count_ranges_from_file(const char *filename, unsigned int *contained, unsigned int *overlap)
+{
+	FILE *fp = NULL;
+	char buf[MAX_LINE_LENGTH];
+	unsigned int s0, e0, s1, e1, pairs;
+
+	*contained = 0;
+	*overlap = 0;
+
+	fp = fopen(filename, "r");
+	if (fp == NULL)
 	{
-		ranges = &cdb->section_ranges[p*4];
-		if (Pair_contained(ranges, ranges+2))
-			sum++;
-		else if (Pair_contained(ranges+2, ranges))
-			sum++;
+		fprintf(stderr, "Failed to open file %s\n", filename);
+		return -1;
 	}
-	return sum;
+
+	pairs = 0;
+	while(fgets(buf, MAX_LINE_LENGTH, fp) != NULL)
+	{
+		if (sscanf(buf, "%u-%u,%u-%u", &s0, &e0, &s1, &e1) != 4)
+			continue;
+
+		*contained += Pair_contained(s0, e0, s1, e1);
+		*overlap += Pair_overlap(s0, e0, s1, e1);
+		pairs++;
+	}
+
+	fclose(fp);
+
+	return pairs;
 }
 
-/*          I0      I1
- *  |--------------|
- *           |--------------|
- *  s0       s1    e0       e1
+/*
+ * Interval index over all section assignments of a Campdb. Assignment a
+ * belongs to pair a/2 and is the first (a%2 == 0) or second elf of the pair.
  *
- * Test if the Intervals I0 = [s0, e0] and I1 = [s1, e1] overlap. This is the case if 
+ * The assignments are sorted by their start section (positions 0 to
+ * intervals-1) and stored in a centered interval tree. Each node holds a
+ * center section and all assignments that cover it, once sorted by start
+ * (by_start) and once by descending end (by_end), as a range
+ * [list_ptr[node], list_ptr[node+1]) of the two lists. Assignments that end
+ * before the center go to the left subtree, the ones starting after it to
+ * the right one. The center is the median start of the node's assignments,
+ * so both subtrees hold at most half of them and the depth is O(log n).
  *
- *   s0 <= s1 <= e0 <= e1  
- * and
- *   s1 <= e0
+ * Additionally all end sections are kept sorted on their own so that
+ * overlap counts reduce to two binary searches. Invalid assignments
+ * (start > end) are not indexed.
+ */
+#define CAMPIDX_NONE UINT_MAX
+
+typedef struct Campidx_p *Campidx;
+
+struct Campidx_p
+{
+	unsigned int intervals;
+	unsigned int *start;
+	unsigned int *end;
+	unsigned int *id;
+	unsigned int *sorted_end;
+	unsigned int max_depth;
+
+	// Centered interval tree, node 0 is the root
+	unsigned int nodes;
+	unsigned int *center;
+	unsigned int *left;
+	unsigned int *right;
+	unsigned int *list_ptr;
+	unsigned int *by_start;
+	unsigned int *by_end;
+};
+
+static const unsigned int *Campidx_sort_key;
+
+int Campidx_compare_key(const void *a, const void *b)
+{
+	unsigned int ka = Campidx_sort_key[*(const unsigned int*)a];
+	unsigned int kb = Campidx_sort_key[*(const unsigned int*)b];
+
+	return (ka > kb) - (ka < kb);
+}
+
+int Campidx_compare_key_desc(const void *a, const void *b)
+{
+	return Campidx_compare_key(b, a);
+}
+
+int Campidx_compare_uint(const void *a, const void *b)
+{
+	unsigned int ua = *(const unsigned int*)a;
+	unsigned int ub = *(const unsigned int*)b;
+
+	return (ua > ub) - (ua < ub);
+}
+
+/*
+ * Build the subtree of the n assignment positions in set, which are sorted
+ * by start. tmp is scratch space of n entries. The node lists are appended
+ * in pre-order, so list_ptr[node+1] is set when the next node is created.
  *
- * */
-unsigned int Pair_overlap(const unsigned int *restrict I0, const unsigned int *restrict I1)
+ * Return: The node index or CAMPIDX_NONE for an empty set.
+ */
+unsigned int Campidx_build_node(Campidx idx, unsigned int *set, const unsigned int n, unsigned int *tmp)
 {
-	if (I0[0] <= I0[1] && I1[0] <= I1[1])
-		if (I0[0] <= I1[0] && I1[0] <= I0[1] && I0[1] <= I1[1]) 
-			return 1;
-		else if (Pair_contained(I0, I1))
-			return 1;
-		else
-			return 0;
-	else
-		fprintf(stderr, "Error in Pair_overlap(): No valid input: I0 = [%d, %d] and I1 = [%d, %d]\n", I0[0], I0[1], I1[0], I1[1]);
-	return 0;
+	unsigned int node, c, i, n_left, n_right, fill;
+
+	if (n == 0)
+		return CAMPIDX_NONE;
+
+	node = idx->nodes++;
+	c = idx->start[set[n/2]];
+	idx->center[node] = c;
+
+	// Stable three way split: left | right into tmp, the rest covers c
+	fill = idx->list_ptr[node];
+	n_left = 0;
+	for (i = 0; i < n; ++i)
+		if (idx->end[set[i]] < c)
+			tmp[n_left++] = set[i];
+	n_right = 0;
+	for (i = 0; i < n; ++i)
+	{
+		if (idx->start[set[i]] > c)
+			tmp[n_left + n_right++] = set[i];
+		else if (idx->end[set[i]] >= c)
+		{
+			idx->by_start[fill] = set[i];
+			idx->by_end[fill] = set[i];
+			fill++;
+		}
+	}
+	idx->list_ptr[node+1] = fill;
+
+	Campidx_sort_key = idx->end;
+	qsort(&idx->by_end[idx->list_ptr[node]], fill - idx->list_ptr[node], sizeof(unsigned int), Campidx_compare_key_desc);
+
+	memcpy(set, tmp, (n_left + n_right) * sizeof(unsigned int));
+	idx->left[node] = Campidx_build_node(idx, set, n_left, tmp);
+	idx->right[node] = Campidx_build_node(idx, set + n_left, n_right, tmp);
+
+	return node;
 }
 
-unsigned int Campdb_sum_overlapping_ranges(const Campdb cdb)
+void Campidx_create(Campidx *idx, const Campdb cdb)
 {
-	unsigned int sum, p, *ranges;
+	unsigned int *all_start, *all_end, *order;
+	unsigned int p, a, i, j, depth;
+
+	*idx = NULL;
+	*idx = (struct Campidx_p*)malloc( sizeof(struct Campidx_p) );
+	if (*idx == NULL)
+	{
+		perror("Failed to create Campidx");
+		return;
+	}
 
-	sum = 0;
+	all_start = (unsigned int*)malloc( 2 * cdb->pairs * sizeof(unsigned int) );
+	all_end = (unsigned int*)malloc( 2 * cdb->pairs * sizeof(unsigned int) );
+	order = (unsigned int*)malloc( 2 * cdb->pairs * sizeof(unsigned int) );
+
+	(*idx)->intervals = 0;
 	for (p = 0; p < cdb->pairs; ++p)
 	{
-		ranges = &cdb->section_ranges[p*4];
-		if (Pair_overlap(&ranges[0], &ranges[2]))
+		all_start[2*p+0] = Campdb_get(cdb->s0, cdb->width, p);
+		all_end[2*p+0] = Campdb_get(cdb->e0, cdb->width, p);
+		all_start[2*p+1] = Campdb_get(cdb->s1, cdb->width, p);
+		all_end[2*p+1] = Campdb_get(cdb->e1, cdb->width, p);
+
+		for (a = 2*p; a < 2*p+2; ++a)
+			if (all_start[a] <= all_end[a])
+				order[(*idx)->intervals++] = a;
+	}
+
+	Campidx_sort_key = all_start;
+	qsort(order, (*idx)->intervals, sizeof(unsigned int), Campidx_compare_key);
+
+	(*idx)->start = (unsigned int*)malloc( (*idx)->intervals * sizeof(unsigned int) );
+	(*idx)->end = (unsigned int*)malloc( (*idx)->intervals * sizeof(unsigned int) );
+	(*idx)->id = order;
+	(*idx)->sorted_end = (unsigned int*)malloc( (*idx)->intervals * sizeof(unsigned int) );
+
+	for (i = 0; i < (*idx)->intervals; ++i)
+	{
+		(*idx)->start[i] = all_start[order[i]];
+		(*idx)->end[i] = all_end[order[i]];
+		(*idx)->sorted_end[i] = all_end[order[i]];
+	}
+	qsort((*idx)->sorted_end, (*idx)->intervals, sizeof(unsigned int), Campidx_compare_uint);
+
+	// The tree has at most one node per assignment
+	(*idx)->nodes = 0;
+	(*idx)->center = (unsigned int*)malloc( ((*idx)->intervals + 1) * sizeof(unsigned int) );
+	(*idx)->left = (unsigned int*)malloc( ((*idx)->intervals + 1) * sizeof(unsigned int) );
+	(*idx)->right = (unsigned int*)malloc( ((*idx)->intervals + 1) * sizeof(unsigned int) );
+	(*idx)->list_ptr = (unsigned int*)malloc( ((*idx)->intervals + 2) * sizeof(unsigned int) );
+	(*idx)->by_start = (unsigned int*)malloc( ((*idx)->intervals + 1) * sizeof(unsigned int) );
+	(*idx)->by_end = (unsigned int*)malloc( ((*idx)->intervals + 1) * sizeof(unsigned int) );
+	(*idx)->list_ptr[0] = 0;
+
+	// all_start and all_end are no longer needed and serve as work space
+	for (i = 0; i < (*idx)->intervals; ++i)
+		all_start[i] = i;
+	Campidx_build_node(*idx, all_start, (*idx)->intervals, all_end);
+
+	// Sweep line over the sorted end points. Sections are closed intervals,
+	// so a start at the same section as an end is counted first.
+	(*idx)->max_depth = 0;
+	depth = 0;
+	for (i = 0, j = 0; i < (*idx)->intervals; )
+	{
+		if ((*idx)->start[i] <= (*idx)->sorted_end[j])
 		{
-			sum++;
+			depth++;
+			if (depth > (*idx)->max_depth)
+				(*idx)->max_depth = depth;
+			i++;
 		}
-		else if (Pair_overlap(&ranges[2], &ranges[0]))
+		else
 		{
-			sum++;
+			depth--;
+			j++;
 		}
 	}
-	return sum;
+
+	free(all_start);
+	free(all_end);
+}
+
+void Campidx_destroy(Campidx *idx)
+{
+	free((*idx)->start);
+	free((*idx)->end);
+	free((*idx)->id);
+	free((*idx)->center);
+	free((*idx)->left);
+	free((*idx)->right);
+	free((*idx)->list_ptr);
+	free((*idx)->by_start);
+	free((*idx)->by_end);
+	free((*idx)->sorted_end);
+	free(*idx);
+	*idx = NULL;
+}
+
+/*
+ * Return: The number of entries in the sorted array a of length n that are
+ * smaller (strict) or smaller or equal (!strict) than x.
+ */
+unsigned int lower_count(const unsigned int *a, const unsigned int n, const unsigned int x, const int strict)
+{
+	unsigned int lo, hi, mid;
+
+	lo = 0;
+	hi = n;
+	while (lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		if (strict ? a[mid] < x : a[mid] <= x)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
 }
 
+/*
+ * Find all assignments that cover section x. The assignment ids are written
+ * to ids, which must be able to hold idx->intervals entries, in no
+ * particular order.
+ *
+ * A single root to leaf path of the interval tree is walked. Left of the
+ * center only the prefix of by_start with start <= x covers x, right of it
+ * only the prefix of by_end with end >= x, so every list entry visited is a
+ * hit except the one stopping the scan. This takes O(log n + k) for k hits.
+ *
+ * Return: The number of covering assignments.
+ */
+unsigned int Campidx_cover(const Campidx idx, const unsigned int x, unsigned int *ids)
+{
+	unsigned int node, j, k;
+
+	k = 0;
+	node = idx->nodes > 0 ? 0 : CAMPIDX_NONE;
+	while (node != CAMPIDX_NONE)
+	{
+		if (x < idx->center[node])
+		{
+			for (j = idx->list_ptr[node]; j < idx->list_ptr[node+1] && idx->start[idx->by_start[j]] <= x; ++j)
+				ids[k++] = idx->id[idx->by_start[j]];
+			node = idx->left[node];
+		}
+		else if (x > idx->center[node])
+		{
+			for (j = idx->list_ptr[node]; j < idx->list_ptr[node+1] && idx->end[idx->by_end[j]] >= x; ++j)
+				ids[k++] = idx->id[idx->by_end[j]];
+			node = idx->right[node];
+		}
+		else
+		{
+			for (j = idx->list_ptr[node]; j < idx->list_ptr[node+1]; ++j)
+				ids[k++] = idx->id[idx->by_start[j]];
+			break;
+		}
+	}
+	return k;
+}
+
+/*
+ * Count the assignments that overlap [a, b]. These are all assignments
+ * except the ones ending before a and the ones starting after b.
+ */
+unsigned int Campidx_count_overlap(const Campidx idx, const unsigned int a, const unsigned int b)
+{
+	if (a > b)
+		return 0;
+
+	return idx->intervals
+		- lower_count(idx->sorted_end, idx->intervals, a, 1)
+		- (idx->intervals - lower_count(idx->start, idx->intervals, b, 0));
+}
+
+/*
+ * Answer a batch of queries, one per line:
+ *
+ *   cover X      assignments (pair:elf) that cover section X
+ *   count A B    number of assignments overlapping [A, B]
+ *   depth        maximum number of assignments covering a single section
+ */
+int Campidx_run_queries(const Campidx idx, const char *filename)
+{
+	FILE *fp = NULL;
+	char buf[MAX_LINE_LENGTH];
+	unsigned int a, b, k, i, *ids;
+
+	fp = fopen(filename, "r");
+	if (fp == NULL)
+	{
+		fprintf(stderr, "Failed to open file %s\n", filename);
+		return 1;
+	}
+
+	ids = (unsigned int*)malloc( (idx->intervals + 1) * sizeof(unsigned int) );
+
+	while(fgets(buf, MAX_LINE_LENGTH, fp) != NULL)
+	{
+		if (sscanf(buf, "cover %u", &a) == 1)
+		{
+			k = Campidx_cover(idx, a, ids);
+			printf("cover %u: %u", a, k);
+			for (i = 0; i < k; ++i)
+				printf(" %u:%u", ids[i] / 2, ids[i] % 2);
+			printf("\n");
+		}
+		else if (sscanf(buf, "count %u %u", &a, &b) == 2)
+			printf("count %u %u: %u\n", a, b, Campidx_count_overlap(idx, a, b));
+		else if (strncmp(buf, "depth", 5) == 0)
+			printf("depth: %u\n", idx->max_depth);
+		else
+			fprintf(stderr, "Unknown query: %s", buf);
+	}
+
+	free(ids);
+	fclose(fp);
+
+	return 0;
+}
+
+/*
+ * Usage: camp-cleanup [-s] [-q <queries>] <file> [validate]
+ *
+ * With -s the file is processed as a stream without storing the pairs. With
+ * -q an interval index is built and the queries from the given file are
+ * answered, see Campidx_run_queries(). The validation pass is only run if an
+ * argument follows the file name.
+ */
 int main(int argc, char **argv)
 {
 	Campdb cdb;
+	Campidx idx;
 	unsigned int sum_camp_ranges_containted, sum_camp_ranges_overlap;
+	int arg, stream;
+	const char *queries;
 
 	Campdb_create(&cdb);
 
-	if (argc  < 2)
+	arg = 1;
+	stream = 0;
+	queries = NULL;
+	while (arg < argc && argv[arg][0] == '-')
+	{
+		if (strcmp(argv[arg], "-s") == 0)
+			stream = 1;
+		else if (strcmp(argv[arg], "-q") == 0 && arg + 1 < argc)
+			queries = argv[++arg];
+		else
+			fprintf(stderr, "Unknown option %s\n", argv[arg]);
+		arg++;
+	}
+
+	if (stream && queries != NULL)
+	{
+		fprintf(stderr, "Queries need the stored pairs and cannot be combined with -s.\n");
+		queries = NULL;
+	}
+
+	if (argc - arg < 1)
 		perror("Not enough input arguments.\n");
 	else
 	{
-		Campdb_read_from_file(argv[1], cdb);
+		if (stream)
+		{
+			printf("%d pairs streamed\n",
+				Campdb_count_ranges_from_file(argv[arg], &sum_camp_ranges_containted, &sum_camp_ranges_overlap));
+		}
+		else
+		{
+			Campdb_read_from_file(argv[arg], cdb);
+
+			if (argc - arg > 1)
+				printf("Invalid pairs: %u\n", Campdb_validate(cdb));
+
+			Campdb_count_ranges(cdb, &sum_camp_ranges_containted, &sum_camp_ranges_overlap);
+
+			if (queries != NULL)
+			{
+				Campidx_create(&idx, cdb);
+				printf("%u assignments indexed\n", idx->intervals);
+				Campidx_run_queries(idx, queries);
+				Campidx_destroy(&idx);
+			}
+		}
 
 		// Part 1: Count fully contained overlapping section ranges
-		sum_camp_ranges_containted = Campdb_sum_contained_ranges(cdb);
 		printf("Number of section ranges that are fully contained in there peers range: %d\n", sum_camp_ranges_containted);
-		
+
 		// Part 2: Count overlaping section ranges
-		sum_camp_ranges_overlap = Campdb_sum_overlapping_ranges(cdb);
 		printf("Number of section ranges that overlap with there peers ranges: %d\n", sum_camp_ranges_overlap);
 	}
 	Campdb_destroy(&cdb);
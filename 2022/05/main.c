@@ -1,10 +1,24 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <ctype.h>
-#include <regex.h>
+#include <pthread.h>
+#include <unistd.h>
+
+/*
+ * Output levels of supply-stacks.
+ */
+#define OUTPUT_NONE 0
+#define OUTPUT_TOPS 1
+#define OUTPUT_FULL 2
 
-#define MAX_LINE_LENGTH 256
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
 
 int is_blank_line(const char *line)
 {
@@ -24,6 +38,14 @@ struct Supplies_p
 	char *crates;
 	unsigned int rearrangements;
 	unsigned int *moves;
+
+	// Checkpoints of the stack state after every checkpoint_interval moves,
+	// see Supplies_build_checkpoints().
+	unsigned int checkpoint_model;
+	unsigned int checkpoint_interval;
+	unsigned int checkpoints;
+	unsigned int *checkpoint_ptr;
+	char *checkpoint_crates;
 };
 
 void Supplies_create(Supplies *supplies)
@@ -32,10 +54,25 @@ void Supplies_create(Supplies *supplies)
 	*supplies = (struct Supplies_p*)malloc( sizeof(struct Supplies_p) );
 	if (*supplies == NULL)
 		perror("Failed to create Supplies.\n");
+	else
+	{
+		(*supplies)->stacks = 0;
+		(*supplies)->crates_ptr = NULL;
+		(*supplies)->crates = NULL;
+		(*supplies)->rearrangements = 0;
+		(*supplies)->moves = NULL;
+		(*supplies)->checkpoint_model = 0;
+		(*supplies)->checkpoint_interval = 0;
+		(*supplies)->checkpoints = 0;
+		(*supplies)->checkpoint_ptr = NULL;
+		(*supplies)->checkpoint_crates = NULL;
+	}
 }
 
 void Supplies_destroy(Supplies *supplies)
 {
+	free((*supplies)->checkpoint_crates);
+	free((*supplies)->checkpoint_ptr);
 	free((*supplies)->moves);
 	free((*supplies)->crates);
 	free((*supplies)->crates_ptr);
@@ -43,275 +80,995 @@ void Supplies_destroy(Supplies *supplies)
 	*supplies = NULL;
 }
 
-void Supplies_read_from_file(const char *filename, Supplies supplies)
+/*
+ * Parse an unsigned decimal number at *ch and advance *ch behind it.
+ *
+ * Return: 1 if at least one digit was read, 0 otherwise.
+ */
+int parse_uint(const char **ch, unsigned int *value)
+{
+	const char *c = *ch;
+
+	*value = 0;
+	while (*c >= '0' && *c <= '9')
+	{
+		*value = *value * 10 + (unsigned int)(*c - '0');
+		c++;
+	}
+
+	if (c == *ch)
+		return 0;
+
+	*ch = c;
+	return 1;
+}
+
+/*
+ * Parse the literal text lit at *ch and advance *ch behind it.
+ *
+ * Return: 1 if the text matches, 0 otherwise.
+ */
+int parse_literal(const char **ch, const char *lit)
+{
+	const char *c = *ch;
+
+	while (*lit != '\0')
+		if (*c++ != *lit++)
+			return 0;
+
+	*ch = c;
+	return 1;
+}
+
+/*
+ * Parse a line of the form "move N from A to B". The stack numbers are
+ * converted to zero based indices.
+ *
+ * Return: 1 if the line is a move, 0 otherwise.
+ */
+int parse_move(const char *line, unsigned int *move)
+{
+	const char *ch = line;
+
+	if (parse_literal(&ch, "move ") && parse_uint(&ch, &move[0])
+	 && parse_literal(&ch, " from ") && parse_uint(&ch, &move[1])
+	 && parse_literal(&ch, " to ") && parse_uint(&ch, &move[2])
+	 && move[1] > 0 && move[2] > 0)
+	{
+		move[1]--;
+		move[2]--;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * The file is read exactly once. The rows of the stack diagram are kept in
+ * memory until the blank line below the stack labels. Then the rows are
+ * transposed into the stacks, the crates of each stack being stored from
+ * the top to the bottom. All following lines are parsed as moves.
+ *
+ *      [D]     row 0
+ *  [N] [C]     row 1
+ *  [Z] [M] [P] row 2
+ *   1   2   3  labels
+ *
+ * The crate of stack s is found at column 4*s+1 of a row.
+ *
+ * The sizes found are printed only for the output level OUTPUT_FULL, errors
+ * are always reported.
+ */
+void Supplies_read_from_file(const char *filename, Supplies supplies, const unsigned int output)
 {
 	FILE *fp = NULL;
-	char buf[MAX_LINE_LENGTH];
-	unsigned int s, c, pos, m, stack_size, max_stack_size;
-	char *ch;
-	regex_t reg;
+	char *line = NULL;
+	size_t line_capacity = 0;
+	ssize_t len;
+	char **rows = NULL;
+	size_t *row_len = NULL;
+	unsigned int n_rows, rows_capacity, moves_capacity, max_stack_size, r, s, c;
+	unsigned int *move;
+	char ch;
 
 	fp = fopen(filename, "r");
 	if (fp == NULL)
 	{
-		fprintf(stderr, "Failed to open %d.\n", filename);
+		fprintf(stderr, "Failed to open %s.\n", filename);
 		return;
 	}
-	else
-	{
+
+	if (output == OUTPUT_FULL)
 		printf("Reading data from \"%s\"\n", filename);
 
-		// Count number of lines for stack pattern
-		pos = 0;
-		while(fgets(buf, MAX_LINE_LENGTH, fp) != NULL)
-			if (!is_blank_line(buf)) 
-				pos++;
-			else
-				break;
+	// Stack diagram including the label row
+	n_rows = 0;
+	rows_capacity = 0;
+	while ((len = getline(&line, &line_capacity, fp)) != -1)
+	{
+		if (is_blank_line(line))
+			break;
+
+		if (n_rows == rows_capacity)
+		{
+			rows_capacity = rows_capacity ? 2 * rows_capacity : 16;
+			rows = (char**)realloc( rows, rows_capacity * sizeof(char*) );
+			row_len = (size_t*)realloc( row_len, rows_capacity * sizeof(size_t) );
+		}
+		rows[n_rows] = line;
+		row_len[n_rows] = len;
+		n_rows++;
 
-		rewind(fp);
+		line = NULL;
+		line_capacity = 0;
+	}
 
-		max_stack_size = pos-1;
+	max_stack_size = n_rows > 0 ? n_rows - 1 : 0;
+	if (output == OUTPUT_FULL)
 		printf("Max stack size: %d\n", max_stack_size);
 
-		for (s = 0; s < pos-1; ++s)
-			fgets(buf, MAX_LINE_LENGTH, fp);
-		
-		memset(buf, '\0', MAX_LINE_LENGTH);	
-		fgets(buf, MAX_LINE_LENGTH, fp);
-		
-		supplies->stacks = 0;
-		for (ch = buf; *ch != '\0'; ++ch)
-			if (!(*ch == ' '))
+	// Count the labels, which may have more than one digit
+	supplies->stacks = 0;
+	if (n_rows > 0)
+		for (c = 0; c < row_len[n_rows-1]; ++c)
+			if (!isspace(rows[n_rows-1][c]) && (c == 0 || isspace(rows[n_rows-1][c-1])))
 				supplies->stacks++;
-
-		supplies->stacks--;
+	if (output == OUTPUT_FULL)
 		printf("Cargo stacks: %d\n", supplies->stacks);
 
-		supplies->crates_ptr = (unsigned int*)malloc( (supplies->stacks+1) * sizeof(unsigned int) );
-
-		rewind(fp);
+	// Transpose the diagram: count the crates per stack, then fill them in
+	supplies->crates_ptr = (unsigned int*)calloc( supplies->stacks + 1, sizeof(unsigned int) );
+	for (r = 0; r < max_stack_size; ++r)
+		for (s = 0, c = 1; s < supplies->stacks && c < row_len[r]; ++s, c += 4)
+			if (!isspace(rows[r][c]))
+				supplies->crates_ptr[s+1]++;
 
-		supplies->crates_ptr[0] = 0;
-		for (s = 0; s < supplies->stacks; ++s)
-		{
-			stack_size = 0;
-			for (pos = 0; pos < max_stack_size; ++pos)
-			{
-				fgets(buf, MAX_LINE_LENGTH, fp);
-				ch = buf+4*s+1;
-				if (*ch != ' ')
-					stack_size++;
-			}
-			supplies->crates_ptr[s+1] = supplies->crates_ptr[s] + stack_size;
-			rewind(fp);
-		}
+	for (s = 0; s < supplies->stacks; ++s)
+		supplies->crates_ptr[s+1] += supplies->crates_ptr[s];
 
+	if (output == OUTPUT_FULL)
 		printf("Total number of crates: %d\n", supplies->crates_ptr[supplies->stacks]);
 
-		supplies->crates= (char *)malloc( supplies->crates_ptr[supplies->stacks] * sizeof(char) );
+	supplies->crates = (char*)malloc( (supplies->crates_ptr[supplies->stacks] + 1) * sizeof(char) );
 
-		c = 0;
-		for (s = 0; s < supplies->stacks; ++s)
+	// crates_ptr[s] is used as insert position and restored afterwards
+	for (r = 0; r < max_stack_size; ++r)
+		for (s = 0, c = 1; s < supplies->stacks && c < row_len[r]; ++s, c += 4)
+			if (!isspace(ch = rows[r][c]))
+				supplies->crates[supplies->crates_ptr[s]++] = ch;
+
+	for (s = supplies->stacks; s > 0; --s)
+		supplies->crates_ptr[s] = supplies->crates_ptr[s-1];
+	supplies->crates_ptr[0] = 0;
+
+	for (r = 0; r < n_rows; ++r)
+		free(rows[r]);
+	free(rows);
+	free(row_len);
+
+	// Moves
+	supplies->rearrangements = 0;
+	moves_capacity = 0;
+	while (getline(&line, &line_capacity, fp) != -1)
+	{
+		if (supplies->rearrangements == moves_capacity)
 		{
-			for (pos = 0; pos < max_stack_size; ++pos)
-			{
-				fgets(buf, MAX_LINE_LENGTH, fp);
-				ch = buf+4*s+1;
-				if (*ch != ' ')
-				{
-					supplies->crates[c] = *ch;
-					c++;
-				}
-			}
-			rewind(fp);
+			moves_capacity = moves_capacity ? 2 * moves_capacity : 1024;
+			supplies->moves = (unsigned int*)realloc( supplies->moves, moves_capacity * 3 * sizeof(unsigned int) );
 		}
 
-		supplies->rearrangements = 0;
-		regcomp(&reg, "^move ([0-9]*) from ([0-9]*) to ([0-9]*)", REG_EXTENDED);
-		while (fgets(buf, MAX_LINE_LENGTH, fp) != NULL)
-		{
-			regmatch_t *pmatch;
+		move = &supplies->moves[supplies->rearrangements*3];
+		if (!parse_move(line, move))
+			continue;
 
-			if (regexec(&reg, buf, 0, pmatch, 0) == 0)
-				supplies->rearrangements++;
+		// Moves must refer to stacks of the diagram
+		if (move[1] >= supplies->stacks || move[2] >= supplies->stacks)
+		{
+			fprintf(stderr, "Ignoring move from %d to %d, there are only %d stacks.\n",
+			        move[1] + 1, move[2] + 1, supplies->stacks);
+			continue;
 		}
 
+		supplies->rearrangements++;
+	}
+
+	if (output == OUTPUT_FULL)
 		printf("Total number of rearrangements: %d\n", supplies->rearrangements);
 
-		supplies->moves = (unsigned int*)malloc( supplies->rearrangements * 3 * sizeof(unsigned int) );
-			
-		rewind(fp);
+	free(line);
+	fclose(fp);
+}
 
-		m = 0;
-		while (fgets(buf, MAX_LINE_LENGTH, fp) != NULL)
-		{
-			regmatch_t *pmatch;
+/*
+ * A single stack of crates. The crates are stored from the bottom (index 0)
+ * to the top (index fill-1) in a buffer that grows on demand, so the memory
+ * of all stacks together is proportional to the total number of crates.
+ *
+ *  fill = 3
+ *  | Z | N | D |   |   |
+ *    0   1   2         capacity
+ *
+ * Stacks are copy-on-write: as long as a stack has not been touched by a
+ * move, crates is NULL and the crates are read from the initial (top to
+ * bottom) crates of the Supplies through shared. Several independent stack
+ * states can thus be run on the same Supplies.
+ */
+typedef struct Crate_stack_t
+{
+	unsigned int fill;
+	unsigned int capacity;
+	char *crates;
+	const char *shared;
+} Crate_stack;
 
-			if (regexec(&reg, buf, 0, pmatch, 0) == 0)
+/*
+ * Copy n bytes from src to dst in reversed order, dst[i] = src[n-1-i]. The
+ * buffers must not overlap. The vector kernels reverse full vectors with a
+ * byte shuffle, the rest is copied byte by byte.
+ */
+void reverse_copy_scalar(char *restrict dst, const char *restrict src, const unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; ++i)
+		dst[i] = src[n-1-i];
+}
+
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("ssse3")))
+void reverse_copy_ssse3(char *restrict dst, const char *restrict src, const unsigned int n)
+{
+	const __m128i rev16 = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+	__m128i w;
+	unsigned int i = 0;
+
+	for (; i + 16 <= n; i += 16)
+	{
+		w = _mm_loadu_si128((const __m128i*)(src + n - i - 16));
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_shuffle_epi8(w, rev16));
+	}
+
+	for (; i < n; ++i)
+		dst[i] = src[n-1-i];
+}
+
+__attribute__((target("avx2")))
+void reverse_copy_avx2(char *restrict dst, const char *restrict src, const unsigned int n)
+{
+	const __m256i rev32 = _mm256_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+	                                       15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+	const __m128i rev16 = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+	__m256i v;
+	__m128i w;
+	unsigned int i = 0;
+
+	for (; i + 32 <= n; i += 32)
+	{
+		v = _mm256_loadu_si256((const __m256i*)(src + n - i - 32));
+		// Reverse the bytes within both 128 bit lanes and swap the lanes
+		v = _mm256_shuffle_epi8(v, rev32);
+		v = _mm256_permute2x128_si256(v, v, 0x01);
+		_mm256_storeu_si256((__m256i*)(dst + i), v);
+	}
+
+	for (; i + 16 <= n; i += 16)
+	{
+		w = _mm_loadu_si128((const __m128i*)(src + n - i - 16));
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_shuffle_epi8(w, rev16));
+	}
+
+	for (; i < n; ++i)
+		dst[i] = src[n-1-i];
+}
+#endif
+
+typedef void (*Reverse_copy)(char *restrict, const char *restrict, const unsigned int);
+
+/*
+ * The reverse_copy() kernel in use. It is set once by reverse_copy_select()
+ * at program start, before any thread is started.
+ */
+Reverse_copy reverse_copy = reverse_copy_scalar;
+
+/*
+ * Pick the widest kernel the CPU supports at runtime.
+ */
+void reverse_copy_select(void)
+{
+#ifdef HAVE_X86_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		reverse_copy = reverse_copy_avx2;
+	else if (__builtin_cpu_supports("ssse3"))
+		reverse_copy = reverse_copy_ssse3;
+#endif
+}
+
+void Crate_stack_reserve(Crate_stack *stack, const unsigned int size)
+{
+	if (size <= stack->capacity)
+		return;
+
+	if (stack->capacity == 0)
+		stack->capacity = 8;
+	while (stack->capacity < size)
+		stack->capacity *= 2;
+
+	stack->crates = (char*)realloc( stack->crates, stack->capacity * sizeof(char) );
+	if (stack->crates == NULL)
+		perror("Failed to grow crate stack.\n");
+}
+
+/*
+ * Give the stack its own copy of the shared initial crates.
+ */
+void Crate_stack_own(Crate_stack *stack)
+{
+	if (stack->shared == NULL)
+		return;
+
+	Crate_stack_reserve(stack, stack->fill);
+	reverse_copy(stack->crates, stack->shared, stack->fill);
+	stack->shared = NULL;
+}
+
+/*
+ * Return: The crate at position p counted from the bottom.
+ */
+char Crate_stack_get(const Crate_stack *stack, const unsigned int p)
+{
+	return stack->shared != NULL ? stack->shared[stack->fill-1-p] : stack->crates[p];
+}
+
+/*
+ * Return: The upper most crate or ' ' for an empty stack.
+ */
+char Crate_stack_top(const Crate_stack *stack)
+{
+	return stack->fill > 0 ? Crate_stack_get(stack, stack->fill-1) : ' ';
+}
+
+/*
+ * Create n_stacks stacks sharing the given compressed crates, which are
+ * stored from the top to the bottom of each stack.
+ */
+Crate_stack *Crate_stacks_create(const unsigned int n_stacks, const unsigned int *crates_ptr, const char *crates)
+{
+	Crate_stack *stacks;
+	unsigned int s;
+
+	stacks = (Crate_stack*)malloc( n_stacks * sizeof(Crate_stack) );
+	if (stacks == NULL)
+	{
+		perror("Failed to create crate stacks.\n");
+		return NULL;
+	}
+
+	for (s = 0; s < n_stacks; ++s)
+	{
+		stacks[s].fill = crates_ptr[s+1] - crates_ptr[s];
+		stacks[s].capacity = 0;
+		stacks[s].crates = NULL;
+		stacks[s].shared = crates + crates_ptr[s];
+	}
+	return stacks;
+}
+
+/*
+ * Write the stacks in compressed form, from the top to the bottom of each
+ * stack, to crates_ptr and crates.
+ */
+void Crate_stacks_save(const Crate_stack *stacks, const unsigned int n_stacks, unsigned int *crates_ptr, char *crates)
+{
+	unsigned int s;
+
+	crates_ptr[0] = 0;
+	for (s = 0; s < n_stacks; ++s)
+	{
+		if (stacks[s].shared != NULL)
+			memcpy(crates + crates_ptr[s], stacks[s].shared, stacks[s].fill * sizeof(char));
+		else
+			reverse_copy(crates + crates_ptr[s], stacks[s].crates, stacks[s].fill);
+		crates_ptr[s+1] = crates_ptr[s] + stacks[s].fill;
+	}
+}
+
+void Crate_stacks_destroy(Crate_stack *stacks, const unsigned int n_stacks)
+{
+	unsigned int s;
+
+	for (s = 0; s < n_stacks; ++s)
+		free(stacks[s].crates);
+	free(stacks);
+}
+
+/*
+ * Render the stacks into one buffer and write it to stdout with a single
+ * write() call. The buffer is sized up front: every stack line takes at
+ * most 2*fill characters for the crates plus the stack number, the fill
+ * count and the brackets.
+ */
+void Crate_stacks_print(const Crate_stack *stacks, const unsigned int n_stacks)
+{
+	char *buf, *ch;
+	size_t size, written;
+	ssize_t n;
+	unsigned int s, p;
+
+	size = 1;
+	for (s = 0; s < n_stacks; ++s)
+		size += 2 * (size_t)stacks[s].fill + 32;
+
+	buf = (char*)malloc( size * sizeof(char) );
+	if (buf == NULL)
+	{
+		perror("Failed to allocate output buffer.\n");
+		return;
+	}
+
+	ch = buf;
+	for (s = 0; s < n_stacks; ++s)
+	{
+		ch += sprintf(ch, "%u : [ ", s);
+		if (stacks[s].shared != NULL)
+			for (p = stacks[s].fill; p > 0; --p)
 			{
-				sscanf(buf, "move %d from %d to %d", &supplies->moves[m*3+0], &supplies->moves[m*3+1], &supplies->moves[m*3+2]);
-				
-				supplies->moves[m*3+1]--;
-				supplies->moves[m*3+2]--;
-				
-				m++;
+				*ch++ = stacks[s].shared[p-1];
+				*ch++ = ' ';
 			}
+		else
+			for (p = 0; p < stacks[s].fill; ++p)
+			{
+				*ch++ = stacks[s].crates[p];
+				*ch++ = ' ';
+			}
+		ch += sprintf(ch, "] (%u)\n", stacks[s].fill);
+	}
+
+	// Keep the order with output that is still buffered in stdout
+	fflush(stdout);
+	for (written = 0; written < (size_t)(ch - buf); written += n)
+	{
+		n = write(STDOUT_FILENO, buf + written, (ch - buf) - written);
+		if (n <= 0)
+		{
+			perror("Failed to write configuration.\n");
+			break;
 		}
-		regfree(&reg);
 	}
-	fclose(fp);
+
+	free(buf);
 }
 
+/*
+ * Move the upper number_of_crates crates from source to dest as one block.
+ * The CrateMover 9000 lifts one crate after the other, which puts the block
+ * upside down onto dest. The CrateMover 9001 keeps the order of the block.
+ * The caller ensures that source holds enough crates and source != dest.
+ */
+void Crate_stack_move_block(Crate_stack *source, Crate_stack *dest, const unsigned int number_of_crates, const unsigned int model)
+{
+	const char *block;
+
+	Crate_stack_own(source);
+	Crate_stack_own(dest);
+	Crate_stack_reserve(dest, dest->fill + number_of_crates);
+
+	block = source->crates + source->fill - number_of_crates;
+	if (model == 9000)
+		reverse_copy(dest->crates + dest->fill, block, number_of_crates);
+	else
+		memcpy(dest->crates + dest->fill, block, number_of_crates * sizeof(char));
+
+	dest->fill += number_of_crates;
+	source->fill -= number_of_crates;
+}
+
+/*
+ * Apply the moves [first, last) to the stacks.
+ *
+ * Return: 0 on success, 1 if a move takes more crates than available.
+ */
+int Crate_stacks_apply_moves(Crate_stack *stacks, const unsigned int *moves, const unsigned int first, const unsigned int last, const unsigned int model)
+{
+	Crate_stack *source, *dest;
+	unsigned int r, number_of_crates;
+
+	for (r = first; r < last; ++r)
+	{
+		number_of_crates = moves[r*3+0];
+		source = &stacks[moves[r*3+1]];
+		dest = &stacks[moves[r*3+2]];
+
+		if (number_of_crates > source->fill)
+		{
+			fprintf(stderr, "Move %d takes %d crates from a stack of %d crates.\n", r, number_of_crates, source->fill);
+			return 1;
+		}
+
+		// Moving crates onto the same stack does not change it
+		if (source == dest)
+			continue;
+
+		Crate_stack_move_block(source, dest, number_of_crates, model);
+	}
+	return 0;
+}
 
 /*
  *  p
- *  5 |   |   |   |
- *  4 |   |   |   |
- *  3 |   |   |   |
  *  2 |   | D |   |
  *  1 | N | C |   |
  *  0 | Z | M | P |
  *     0   1   2    s
  *
+ * The crates of the Supplies are stored from the top to the bottom of each
+ * stack. They are copied into one Crate_stack per stack, the moves are
+ * applied and the final configuration is copied back from the bottom to the
+ * top of each stack. The initial and final configuration are only printed
+ * for the output level OUTPUT_FULL.
  */
-int Supplies_apply_moves(Supplies supplies, unsigned int model)
+int Supplies_apply_moves(Supplies supplies, unsigned int model, const unsigned int output)
 {
-	unsigned int *stack_fill;
-	char *crates_map;
-	unsigned int max_stack_size = supplies->crates_ptr[supplies->stacks];
-	unsigned int s, p, r, m, c, number_of_crates, source_stack, dest_stack, source_idx, dest_idx;
+	Crate_stack *stacks;
+	unsigned int s, c;
+	int status;
 
-	stack_fill = (unsigned int*)malloc( supplies->stacks * sizeof(unsigned int) );
-	crates_map = (char*)malloc( supplies->stacks * max_stack_size * sizeof(char) );
+	if (model != 9000 && model != 9001)
+	{
+		perror("Unknown CrateMover model (9000 or 9001)\n");
+		return 1;
+	}
 
-	// Copy to fixed size data structure
-	for (s = 0; s < supplies->stacks; ++s)
+	stacks = Crate_stacks_create(supplies->stacks, supplies->crates_ptr, supplies->crates);
+
+	if (output >= OUTPUT_FULL)
 	{
-		for (p = 0; p < max_stack_size; ++p)
-			crates_map[s*max_stack_size+p] = ' ';
+		printf("Initial configuration:\n");
+		Crate_stacks_print(stacks, supplies->stacks);
+	}
+
+	status = Crate_stacks_apply_moves(stacks, supplies->moves, 0, supplies->rearrangements, model);
 
-		for (stack_fill[s] = 0, p = supplies->crates_ptr[s+1]; p > supplies->crates_ptr[s]; --p, stack_fill[s]++)
-			crates_map[s*max_stack_size+stack_fill[s]] = supplies->crates[p-1];
+	if (output >= OUTPUT_FULL)
+	{
+		printf("Final configuration:\n");
+		Crate_stacks_print(stacks, supplies->stacks);
 	}
 
-	printf("Initial configuration:\n");
+	// The crates are overwritten below, detach all stacks first
+	for (s = 0; s < supplies->stacks; ++s)
+		Crate_stack_own(&stacks[s]);
+
+	// Copy back to compressed data structure
+	supplies->crates_ptr[0] = 0;
+	c = 0;
 	for (s = 0; s < supplies->stacks; ++s)
 	{
-		printf("%d : [ ", s);
-		for (p = 0; p < max_stack_size; ++p)
-			printf("%c ", crates_map[s*max_stack_size+p]);
-		printf("] (%d)\n", stack_fill[s]);
+		supplies->crates_ptr[s+1] = supplies->crates_ptr[s] + stacks[s].fill;
+
+		memcpy(supplies->crates + c, stacks[s].crates, stacks[s].fill * sizeof(char));
+		c += stacks[s].fill;
 	}
 
-	// Move crates
-	if (model == 9000)
+	Crate_stacks_destroy(stacks, supplies->stacks);
+
+	return status;
+}
+
+/*
+ * One CrateMover run on a private copy-on-write stack state. The Supplies
+ * are only read, so runs for different models can share them.
+ */
+typedef struct Supplies_run_t
+{
+	Supplies supplies;
+	unsigned int model;
+	char *tops;
+	int status;
+} Supplies_run;
+
+void *Supplies_run_worker(void *arg)
+{
+	Supplies_run *run = (Supplies_run*)arg;
+	Crate_stack *stacks;
+	unsigned int s;
+
+	stacks = Crate_stacks_create(run->supplies->stacks, run->supplies->crates_ptr, run->supplies->crates);
+	run->status = Crate_stacks_apply_moves(stacks, run->supplies->moves, 0, run->supplies->rearrangements, run->model);
+
+	for (s = 0; s < run->supplies->stacks; ++s)
+		run->tops[s] = Crate_stack_top(&stacks[s]);
+
+	Crate_stacks_destroy(stacks, run->supplies->stacks);
+
+	return NULL;
+}
+
+/*
+ * Run the CrateMover 9000 and 9001 at the same time on two threads. The
+ * upper most crates are written to tops_9000 and tops_9001.
+ *
+ * Return: 0 on success, 1 if one of the runs failed.
+ */
+int Supplies_apply_moves_both(const Supplies supplies, char *tops_9000, char *tops_9001)
+{
+	Supplies_run runs[2];
+	pthread_t tids[2];
+	int t, joinable[2];
+
+	runs[0].model = 9000;
+	runs[0].tops = tops_9000;
+	runs[1].model = 9001;
+	runs[1].tops = tops_9001;
+
+	for (t = 0; t < 2; ++t)
 	{
-		for (r = 0; r < supplies->rearrangements; ++r)
-		{
-			number_of_crates = supplies->moves[r*3+0];
-			source_stack = supplies->moves[r*3+1];
-			dest_stack = supplies->moves[r*3+2];
-	
-			for (m = 0; m < number_of_crates; ++m)
-			{
-				source_idx = source_stack*max_stack_size+stack_fill[source_stack]-1;
-				dest_idx = dest_stack*max_stack_size+stack_fill[dest_stack];
-	
-				crates_map[dest_idx] = crates_map[source_idx];
-				crates_map[source_idx] = ' ';
-				stack_fill[dest_stack]++;
-				stack_fill[source_stack]--;
-			}
-		}
+		runs[t].supplies = supplies;
+		runs[t].status = 0;
+		joinable[t] = pthread_create(&tids[t], NULL, Supplies_run_worker, &runs[t]) == 0;
+		if (!joinable[t])
+			Supplies_run_worker(&runs[t]);
 	}
-	else if (model == 9001)
+
+	for (t = 0; t < 2; ++t)
+		if (joinable[t])
+			pthread_join(tids[t], NULL);
+
+	return runs[0].status || runs[1].status;
+}
+
+/*
+ * Store the stack state of the given model every interval moves, i.e. after
+ * the moves 0, interval, 2*interval, ... Each checkpoint takes the total
+ * number of crates plus stacks+1 offsets, so a smaller interval trades
+ * memory for shorter replays in Supplies_state_after_move().
+ *
+ * Return: 0 on success, 1 on invalid input or moves.
+ */
+int Supplies_build_checkpoints(Supplies supplies, const unsigned int model, const unsigned int interval)
+{
+	Crate_stack *stacks;
+	unsigned int c, first, last;
+	size_t total, row, checkpoints, per_checkpoint;
+	int status = 0;
+
+	if (model != 9000 && model != 9001)
 	{
-		for (r = 0; r < supplies->rearrangements; ++r)
-		{
-			number_of_crates = supplies->moves[r*3+0];
-			source_stack = supplies->moves[r*3+1];
-			dest_stack = supplies->moves[r*3+2];
+		perror("Unknown CrateMover model (9000 or 9001)\n");
+		return 1;
+	}
+	if (interval == 0)
+	{
+		fprintf(stderr, "The checkpoint interval must be positive.\n");
+		return 1;
+	}
 
-			for (m = 0; m < number_of_crates; ++m)
-			{
-				source_idx = source_stack*max_stack_size+stack_fill[source_stack]-number_of_crates+m;
-				dest_idx = dest_stack*max_stack_size+stack_fill[dest_stack];
-	
-				crates_map[dest_idx] = crates_map[source_idx];
-				crates_map[source_idx] = ' ';
-				stack_fill[dest_stack]++;
-			}
-			stack_fill[source_stack] -= number_of_crates;
+	free(supplies->checkpoint_ptr);
+	free(supplies->checkpoint_crates);
+
+	supplies->checkpoint_ptr = NULL;
+	supplies->checkpoint_crates = NULL;
+	supplies->checkpoints = 0;
+
+	// The checkpoint sizes are computed in size_t and checked for overflow,
+	// as they grow with the product of moves and crates.
+	total = supplies->crates_ptr[supplies->stacks];
+	row = (size_t)supplies->stacks + 1;
+	checkpoints = supplies->rearrangements / interval + 1;
+	per_checkpoint = total > row * sizeof(unsigned int) ? total : row * sizeof(unsigned int);
+	if (checkpoints > (SIZE_MAX - 1) / per_checkpoint)
+	{
+		fprintf(stderr, "%zu checkpoints of %zu crates do not fit into memory.\n", checkpoints, total);
+		return 1;
+	}
+
+	supplies->checkpoint_model = model;
+	supplies->checkpoint_interval = interval;
+	supplies->checkpoint_ptr = (unsigned int*)malloc( checkpoints * row * sizeof(unsigned int) );
+	supplies->checkpoint_crates = (char*)malloc( (checkpoints * total + 1) * sizeof(char) );
+	if (supplies->checkpoint_ptr == NULL || supplies->checkpoint_crates == NULL)
+	{
+		perror("Failed to allocate checkpoints.\n");
+		return 1;
+	}
+	supplies->checkpoints = checkpoints;
+
+	stacks = Crate_stacks_create(supplies->stacks, supplies->crates_ptr, supplies->crates);
+	for (c = 0; c < supplies->checkpoints && status == 0; ++c)
+	{
+		if (c > 0)
+		{
+			first = (c - 1) * interval;
+			last = c * interval;
+			status = Crate_stacks_apply_moves(stacks, supplies->moves, first, last, model);
 		}
+		Crate_stacks_save(stacks, supplies->stacks,
+			&supplies->checkpoint_ptr[(size_t)c * row],
+			&supplies->checkpoint_crates[(size_t)c * total]);
 	}
-	else
+	Crate_stacks_destroy(stacks, supplies->stacks);
+
+	if (status != 0)
+		supplies->checkpoints = 0;
+
+	return status;
+}
+
+/*
+ * Restore the stack state after the first m moves from the nearest
+ * checkpoint before m and replay at most checkpoint_interval-1 moves. The
+ * returned stacks share the checkpoint data (copy-on-write) and have to be
+ * released with Crate_stacks_destroy().
+ *
+ * Return: The stacks or NULL if m is out of range or no checkpoints exist.
+ */
+Crate_stack *Supplies_state_after_move(const Supplies supplies, const unsigned int m)
+{
+	Crate_stack *stacks;
+	unsigned int c;
+
+	if (supplies->checkpoints == 0 || m > supplies->rearrangements)
+		return NULL;
+
+	c = m / supplies->checkpoint_interval;
+	stacks = Crate_stacks_create(supplies->stacks,
+		&supplies->checkpoint_ptr[(size_t)c * ((size_t)supplies->stacks + 1)],
+		&supplies->checkpoint_crates[(size_t)c * supplies->crates_ptr[supplies->stacks]]);
+
+	if (Crate_stacks_apply_moves(stacks, supplies->moves, c * supplies->checkpoint_interval, m, supplies->checkpoint_model) != 0)
+	{
+		Crate_stacks_destroy(stacks, supplies->stacks);
+		return NULL;
+	}
+	return stacks;
+}
+
+/*
+ * Determine the upper most crate of every stack after all moves without
+ * moving any crates. Only the stack sizes are simulated forwards. Then the
+ * final top position of each stack is traced backwards through the moves
+ * to its position in the initial stacks:
+ *
+ *  A position (t, i), i counted from the bottom, lies in the block of move
+ *  r = (n, src, dst) if t == dst and i >= fill[dst] - n (fills after the
+ *  move). With offset k = i - (fill[dst] - n) within the block it came from
+ *  position fill[src] + n - 1 - k (9000, block reversed) or
+ *  fill[src] + k (9001, block kept) of src.
+ *
+ * The cost is O(stacks x moves). Empty stacks get a ' '.
+ *
+ * Return: 0 on success, 1 for an unknown model or an invalid move.
+ */
+int Supplies_top_crates(const Supplies supplies, const unsigned int model, char *tops)
+{
+	unsigned int *fill, *pos_stack, *pos_idx;
+	unsigned int s, r, n, src, dst, k, t;
+	int status = 0;
+
+	if (model != 9000 && model != 9001)
 	{
 		perror("Unknown CrateMover model (9000 or 9001)\n");
 		return 1;
 	}
 
-	printf("Final configuration:\n");
+	fill = (unsigned int*)malloc( supplies->stacks * sizeof(unsigned int) );
+	pos_stack = (unsigned int*)malloc( supplies->stacks * sizeof(unsigned int) );
+	pos_idx = (unsigned int*)malloc( supplies->stacks * sizeof(unsigned int) );
+
 	for (s = 0; s < supplies->stacks; ++s)
+		fill[s] = supplies->crates_ptr[s+1] - supplies->crates_ptr[s];
+
+	// Forward: final stack sizes
+	for (r = 0; r < supplies->rearrangements; ++r)
 	{
-		printf("%d : [ ", s);
-		for (p = 0; p < max_stack_size; ++p)
-			printf("%c ", crates_map[s*max_stack_size+p]);
-		printf("] (%d)\n", stack_fill[s]);
+		n = supplies->moves[r*3+0];
+		src = supplies->moves[r*3+1];
+		dst = supplies->moves[r*3+2];
+		if (n > fill[src])
+		{
+			fprintf(stderr, "Move %d takes %d crates from a stack of %d crates.\n", r, n, fill[src]);
+			status = 1;
+			break;
+		}
+		fill[src] -= n;
+		fill[dst] += n;
 	}
 
-	// Copy back to compressed data structure
-	supplies->crates_ptr[0] = 0;
-	c = 0;
-	for (s = 0; s < supplies->stacks; ++s)
+	if (status == 0)
 	{
-		supplies->crates_ptr[s+1] = supplies->crates_ptr[s] + stack_fill[s];
+		for (s = 0; s < supplies->stacks; ++s)
+		{
+			pos_stack[s] = s;
+			pos_idx[s] = fill[s] - 1;
+		}
 
-		for (p = 0; p < stack_fill[s]; ++p)
+		// Backward: trace the top positions
+		for (r = supplies->rearrangements; r > 0; --r)
 		{
-			supplies->crates[c] = crates_map[s*max_stack_size+p];
-			c++;
+			n = supplies->moves[(r-1)*3+0];
+			src = supplies->moves[(r-1)*3+1];
+			dst = supplies->moves[(r-1)*3+2];
+			if (src == dst)
+				continue;
+
+			for (s = 0; s < supplies->stacks; ++s)
+			{
+				if (pos_idx[s] == (unsigned int)-1 || pos_stack[s] != dst || pos_idx[s] < fill[dst] - n)
+					continue;
+
+				k = pos_idx[s] - (fill[dst] - n);
+				pos_stack[s] = src;
+				pos_idx[s] = model == 9000 ? fill[src] + n - 1 - k : fill[src] + k;
+			}
+
+			fill[dst] -= n;
+			fill[src] += n;
+		}
+
+		// Initial crates are stored from the top to the bottom
+		for (s = 0; s < supplies->stacks; ++s)
+		{
+			if (pos_idx[s] == (unsigned int)-1)
+			{
+				tops[s] = ' ';
+				continue;
+			}
+			t = pos_stack[s];
+			tops[s] = supplies->crates[supplies->crates_ptr[t+1] - 1 - pos_idx[s]];
 		}
 	}
 
+	free(pos_idx);
+	free(pos_stack);
+	free(fill);
 
-	free(crates_map);
-	free(stack_fill);	
+	return status;
+}
 
-	return 0;
+void Supplies_print_top_crates(const unsigned int n_stacks, const char *tops, const unsigned int model)
+{
+	unsigned int s;
+
+	printf("Upper most crates in stacks using CrateMover %d:\n", model);
+	printf("Stack: ");
+	for (s = 0; s < n_stacks; ++s)
+		printf("%d ", s);
+	printf("\n");
+	printf("Crate: ");
+	for (s = 0; s < n_stacks; ++s)
+		printf("%c ", tops[s]);
+	printf("\n");
 }
 
+/*
+ * Usage: supply-stacks [-t] [-k <interval>] [-o none|tops|full] <model> <file> [move ...]
+ *
+ * The model is 9000, 9001 or both. With both the file is parsed once and
+ * the two models are run at the same time. With -t only the upper most
+ * crates are determined by tracing the moves backwards, see
+ * Supplies_top_crates(). Otherwise the moves are applied.
+ *
+ * With -k checkpoints are stored every <interval> moves and the stack state
+ * after each of the given move counts is printed instead. This needs a
+ * single model, 9000 or 9001.
+ *
+ * The output level -o selects what is printed of the result: nothing, the
+ * upper most crates only or additionally the full initial and final
+ * configuration (default).
+ */
 int main(int argc, char **argv)
 {
 	Supplies supplies;
-	unsigned int crate_mover_model;
+	Crate_stack *state;
+	unsigned int crate_mover_model, s, interval, output;
+	int arg, q, trace, both, status;
+	char *tops, *tops_9001;
+
+	reverse_copy_select();
+
+	arg = 1;
+	trace = 0;
+	interval = 0;
+	output = OUTPUT_FULL;
+	while (arg < argc && argv[arg][0] == '-')
+	{
+		if (strcmp(argv[arg], "-t") == 0)
+			trace = 1;
+		else if (strcmp(argv[arg], "-k") == 0 && arg + 1 < argc)
+			interval = atoi(argv[++arg]);
+		else if (strcmp(argv[arg], "-o") == 0 && arg + 1 < argc)
+		{
+			arg++;
+			if (strcmp(argv[arg], "none") == 0)
+				output = OUTPUT_NONE;
+			else if (strcmp(argv[arg], "tops") == 0)
+				output = OUTPUT_TOPS;
+			else if (strcmp(argv[arg], "full") == 0)
+				output = OUTPUT_FULL;
+			else
+			{
+				fprintf(stderr, "Unknown output level %s (none, tops or full)\n", argv[arg]);
+				return 1;
+			}
+		}
+		else
+			fprintf(stderr, "Unknown option %s\n", argv[arg]);
+		arg++;
+	}
 
-	if (argc < 3)
+	if (argc - arg < 2)
 	{
 		perror("Not enough input arguments.\n");
 		return 1;
 	}
 	else
 	{
+		both = strcmp(argv[arg], "both") == 0;
+
+		// The checkpoints are kept for a single model only
+		if (interval > 0 && both)
+		{
+			fprintf(stderr, "Checkpoints (-k) need model 9000 or 9001, not both.\n");
+			return 1;
+		}
+
 		Supplies_create(&supplies);
 
-		Supplies_read_from_file(argv[2], supplies);
+		Supplies_read_from_file(argv[arg+1], supplies, output);
+
+	  	crate_mover_model = both ? 9000 : atoi(argv[arg]);
+		tops = (char*)malloc( (supplies->stacks + 1) * sizeof(char) );
+		tops_9001 = (char*)malloc( (supplies->stacks + 1) * sizeof(char) );
+
+		if (interval > 0)
+		{
+			status = Supplies_build_checkpoints(supplies, crate_mover_model, interval);
+			if (output == OUTPUT_FULL)
+				printf("Checkpoints: %d every %d moves\n", supplies->checkpoints, interval);
+
+			for (q = arg + 2; status == 0 && q < argc; ++q)
+			{
+				state = Supplies_state_after_move(supplies, atoi(argv[q]));
+				if (state == NULL)
+				{
+					fprintf(stderr, "No state after move %s.\n", argv[q]);
+					continue;
+				}
+				printf("State after move %d:\n", atoi(argv[q]));
+				Crate_stacks_print(state, supplies->stacks);
+				Crate_stacks_destroy(state, supplies->stacks);
+			}
 
-	  	crate_mover_model = atoi(argv[1]);
-		Supplies_apply_moves(supplies, crate_mover_model);
+			free(tops_9001);
+			free(tops);
+			Supplies_destroy(&supplies);
+			return status;
+		}
 
-		printf("Upper most crates in stacks using CrateMover %d:\n", crate_mover_model);
-		printf("Stack: ");
-		for (int s = 0; s < supplies->stacks; ++s)
-			printf("%d ", s);
-		printf("\n");
-		printf("Crate: ");
-		for (int s = 0; s < supplies->stacks; ++s)
-			printf("%c ", supplies->crates[supplies->crates_ptr[s+1]-1]);
-		printf("\n");
+		if (both && trace)
+			status = Supplies_top_crates(supplies, 9000, tops) || Supplies_top_crates(supplies, 9001, tops_9001);
+		else if (both)
+			status = Supplies_apply_moves_both(supplies, tops, tops_9001);
+		else if (trace)
+			status = Supplies_top_crates(supplies, crate_mover_model, tops);
+		else
+		{
+			status = Supplies_apply_moves(supplies, crate_mover_model, output);
+			for (s = 0; s < supplies->stacks; ++s)
+				tops[s] = supplies->crates_ptr[s+1] > supplies->crates_ptr[s] ? supplies->crates[supplies->crates_ptr[s+1]-1] : ' ';
+		}
 
+		if (status == 0 && output >= OUTPUT_TOPS)
+		{
+			Supplies_print_top_crates(supplies->stacks, tops, crate_mover_model);
+			if (both)
+				Supplies_print_top_crates(supplies->stacks, tops_9001, 9001);
+		}
+
+		free(tops_9001);
+		free(tops);
 		Supplies_destroy(&supplies);
 	}
 
-	return 0;
+	return status;
 }
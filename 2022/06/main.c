@@ -1,12 +1,28 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+
+#define BITMASK_BLOCK 4096
+#define BITMASK_MAX_WINDOW 26
+
+#ifndef MIN_CHUNK_SIZE
+#define MIN_CHUNK_SIZE (1 << 20)
+#endif
 
 typedef struct Elfstream_p *Elfstream;
 
 struct Elfstream_p
 {
-	unsigned int len;
+	size_t len;
 	char *buf;	
 };
 
@@ -35,85 +51,801 @@ void Elfstream_read_from_file(const char *filename, Elfstream es)
 	{
 		printf("Reading datastream buffer from file \'%s\'\n", filename);
 
-		es->len = 0;
-		while (fgetc(fp) != EOF) 
-			es->len++;
+		fseek(fp, 0, SEEK_END);
+		es->len = ftell(fp);
+		rewind(fp);
 
-		es->buf = (char*)malloc( es->len * sizeof(char) );
+		es->buf = (char*)malloc( (es->len + 1) * sizeof(char) );
 
-		rewind(fp);
+		es->len = fread(es->buf, sizeof(char), es->len, fp);
 
-		fgets(es->buf, es->len, fp);
+		// The datastream ends at the first line break
+		es->buf[es->len] = '\0';
+		es->len = strcspn(es->buf, "\n");
 
 		fclose(fp);
 	}
 }
 
-int Block_all_char_differ(const unsigned int len, const char *cblock)
+/*
+ * Find the first marker for each of the n window sizes in a single pass,
+ * i.e. the first position c such that the windows[w] characters before c
+ * are all different. The last position of every byte value is kept in a
+ * table and start is the begin of the longest run of different characters
+ * ending at the current byte. This state is shared by all windows: a
+ * window is found as soon as the run is at least as long as the window.
+ * The windows are visited in increasing size, so each byte costs O(1)
+ * amortized. The scan stops once all markers are found.
+ *
+ * The result for windows[w] is stored in markers[w]: the number of
+ * characters processed up to the end of the first marker or -1 if there is
+ * no marker.
+ *
+ * Return: The number of markers found.
+ */
+unsigned int Elfstream_find_markers(const Elfstream es, const unsigned int n, const unsigned int *windows, long *markers)
 {
-	int i, j;
+	size_t last[256];
+	size_t c, start, run;
+	unsigned int *order;
+	unsigned int w, k, next;
+	unsigned char ch;
 
-	//printf("%s\n", cblock);
+	order = (unsigned int*)malloc( (n + 1) * sizeof(unsigned int) );
 
-	for (i = 0; i < len; ++i)
-		for (j = i+1; j < len; ++j)
+	// Insertion sort of the window indices by window size
+	for (w = 0; w < n; ++w)
+	{
+		markers[w] = -1;
+		for (k = w; k > 0 && windows[order[k-1]] > windows[w]; --k)
+			order[k] = order[k-1];
+		order[k] = w;
+	}
+
+	// last[] holds positions + 1, so 0 means not seen
+	for (c = 0; c < 256; ++c)
+		last[c] = 0;
+
+	// Empty windows are found before the first character
+	next = 0;
+	while (next < n && windows[order[next]] == 0)
+		markers[order[next++]] = 0;
+
+	start = 0;
+	for (c = 0; c < es->len && next < n; ++c)
+	{
+		ch = (unsigned char)es->buf[c];
+		if (last[ch] > start)
+			start = last[ch];
+		last[ch] = c + 1;
+
+		run = c + 1 - start;
+		while (next < n && windows[order[next]] <= run)
+			markers[order[next++]] = c + 1;
+	}
+
+	free(order);
+
+	return next;
+}
+
+/*
+ * Find the first marker of the given window size, see
+ * Elfstream_find_markers().
+ */
+long Elfstream_find_marker(const Elfstream es, const unsigned int window)
+{
+	long marker;
+
+	Elfstream_find_markers(es, 1, &window, &marker);
+	return marker;
+}
+
+/*
+ * Scan buf[from, to) with a fresh sliding window state, see
+ * Elfstream_find_markers(). Every cancel_interval bytes the scan checks if
+ * it has been cancelled, i.e. if *best is smaller than chunk.
+ *
+ * Return: The end position of the first marker in the range or -1.
+ */
+long Elfstream_scan_range(const char *buf, const size_t from, const size_t to, const unsigned int window,
+                          const unsigned int chunk, atomic_uint *best)
+{
+	const size_t cancel_interval = 1 << 16;
+	size_t last[256];
+	size_t c, start;
+	unsigned char ch;
+
+	for (c = 0; c < 256; ++c)
+		last[c] = 0;
+
+	// last[] holds positions + 1, so 0 means not seen
+	start = from;
+	for (c = from; c < to; ++c)
+	{
+		if ((c - from) % cancel_interval == 0 && atomic_load(best) < chunk)
+			return -1;
+
+		ch = (unsigned char)buf[c];
+		if (last[ch] > start)
+			start = last[ch];
+		last[ch] = c + 1;
+
+		if (c + 1 - start >= window)
+			return c + 1;
+	}
+	return -1;
+}
+
+typedef struct Elfstream_search_t
+{
+	Elfstream es;
+	unsigned int window;
+	size_t chunk_size;
+	unsigned int chunks;
+	atomic_uint next_chunk;
+	atomic_uint best;
+	long *results;
+} Elfstream_search;
+
+/*
+ * Take chunks in increasing order until there are none left or an earlier
+ * chunk has already reported a marker.
+ */
+void *Elfstream_search_worker(void *arg)
+{
+	Elfstream_search *search = (Elfstream_search*)arg;
+	unsigned int k, best;
+	size_t from, to;
+
+	while ((k = atomic_fetch_add(&search->next_chunk, 1)) < search->chunks)
+	{
+		if (atomic_load(&search->best) < k)
+			break;
+
+		// Markers ending in this chunk need window-1 bytes from the one before
+		from = k * search->chunk_size;
+		from = from > search->window - 1 ? from - (search->window - 1) : 0;
+		to = (k + 1) * search->chunk_size;
+		if (to > search->es->len)
+			to = search->es->len;
+
+		search->results[k] = Elfstream_scan_range(search->es->buf, from, to, search->window, k, &search->best);
+
+		if (search->results[k] >= 0)
 		{
-			//printf(" %c ?= %c\n", cblock[i], cblock[j]);
-			if (cblock[i] == cblock[j]) return 0;
+			best = atomic_load(&search->best);
+			while (k < best && !atomic_compare_exchange_weak(&search->best, &best, k))
+				;
 		}
+	}
+	return NULL;
+}
+
+/*
+ * Multi-threaded version of Elfstream_find_marker(). The datastream is split
+ * into chunks that overlap by window-1 bytes, so every marker lies entirely
+ * in the chunk its last byte belongs to. The chunks are scanned in parallel
+ * and the earliest hit wins. Once a chunk reports a marker, all later
+ * chunks are cancelled. As every hit is a valid marker and the chunk of the
+ * first marker is never cancelled, the result equals the serial scan.
+ *
+ * Return: The end position of the first marker or -1.
+ */
+long Elfstream_find_marker_parallel(const Elfstream es, const unsigned int window, unsigned int threads)
+{
+	Elfstream_search search;
+	pthread_t *tids;
+	int *joinable;
+	unsigned int t, k;
+	long marker;
+
+	if (window == 0)
+		return 0;
+	if (threads < 1)
+		threads = 1;
+
+	// A few chunks per thread keep the threads busy until the first hit
+	search.es = es;
+	search.window = window;
+	search.chunk_size = es->len / (8 * threads) + 1;
+	if (search.chunk_size < MIN_CHUNK_SIZE)
+		search.chunk_size = MIN_CHUNK_SIZE;
+	search.chunks = (es->len + search.chunk_size - 1) / search.chunk_size;
+	atomic_init(&search.next_chunk, 0);
+	atomic_init(&search.best, search.chunks);
+	search.results = (long*)malloc( (search.chunks + 1) * sizeof(long) );
+	for (k = 0; k < search.chunks; ++k)
+		search.results[k] = -1;
+
+	tids = (pthread_t*)malloc( threads * sizeof(pthread_t) );
+	joinable = (int*)malloc( threads * sizeof(int) );
+	for (t = 0; t < threads; ++t)
+	{
+		joinable[t] = pthread_create(&tids[t], NULL, Elfstream_search_worker, &search) == 0;
+		if (!joinable[t])
+			Elfstream_search_worker(&search);
+	}
+	for (t = 0; t < threads; ++t)
+		if (joinable[t])
+			pthread_join(tids[t], NULL);
 
-	return 1;
+	marker = -1;
+	for (k = 0; k < search.chunks; ++k)
+		if (search.results[k] >= 0 && (marker < 0 || search.results[k] < marker))
+			marker = search.results[k];
+
+	free(joinable);
+	free(tids);
+	free(search.results);
+
+	return marker;
+}
+
+long Elfstream_get_start_of_pack_marker(Elfstream es)
+{
+	return Elfstream_find_marker(es, 4);
+}
+
+long Elfstream_get_start_of_message_marker(Elfstream es)
+{
+	return Elfstream_find_marker(es, 14);
+}
+
+/*
+ * Bitmask kernels for short windows over lower case letters. Every letter
+ * is mapped to a 32 bit mask 1 << (c - 'a') and the masks are combined into
+ * a prefix XOR, P[i+1] = P[i] ^ mask[i]. The XOR of the masks of the window
+ * starting at k is P[k+window] ^ P[k]. Its popcount equals window if and
+ * only if all letters of the window are different, since letters occurring
+ * twice cancel out and every letter adds at most one bit. Each start
+ * position thus costs O(1) for any window size.
+ *
+ * The scan functions test the windows starting at the positions
+ * [0, positions) of the prefix array and return the first start position of
+ * a marker or -1. The vector versions test 4 (SSE2) or 8 (AVX2) start
+ * positions per iteration with a SWAR (SSE2) or nibble table (AVX2)
+ * popcount on the 32 bit lanes.
+ */
+long bitmask_scan_scalar(const unsigned int *prefix, const size_t positions, const unsigned int window)
+{
+	size_t p;
+	unsigned int x, bits;
+
+	for (p = 0; p < positions; ++p)
+	{
+		x = prefix[p+window] ^ prefix[p];
+		for (bits = 0; x != 0; x &= x - 1)
+			bits++;
+		if (bits == window)
+			return p;
+	}
+	return -1;
+}
+
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("sse2")))
+long bitmask_scan_sse2(const unsigned int *prefix, const size_t positions, const unsigned int window)
+{
+	const __m128i m1 = _mm_set1_epi32(0x55555555);
+	const __m128i m2 = _mm_set1_epi32(0x33333333);
+	const __m128i m4 = _mm_set1_epi32(0x0f0f0f0f);
+	const __m128i w = _mm_set1_epi32(window);
+	__m128i x;
+	size_t p;
+	int bits;
+	long tail;
+
+	for (p = 0; p + 4 <= positions; p += 4)
+	{
+		x = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(prefix + p + window)),
+		                  _mm_loadu_si128((const __m128i*)(prefix + p)));
+
+		// Population count of every 32 bit lane
+		x = _mm_sub_epi32(x, _mm_and_si128(_mm_srli_epi32(x, 1), m1));
+		x = _mm_add_epi32(_mm_and_si128(x, m2), _mm_and_si128(_mm_srli_epi32(x, 2), m2));
+		x = _mm_and_si128(_mm_add_epi32(x, _mm_srli_epi32(x, 4)), m4);
+		x = _mm_add_epi32(x, _mm_srli_epi32(x, 8));
+		x = _mm_and_si128(_mm_add_epi32(x, _mm_srli_epi32(x, 16)), _mm_set1_epi32(0x3f));
+
+		bits = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(x, w)));
+		if (bits)
+			return p + __builtin_ctz(bits);
+	}
+
+	tail = bitmask_scan_scalar(prefix + p, positions - p, window);
+	return tail < 0 ? -1 : (long)p + tail;
+}
+
+__attribute__((target("avx2")))
+long bitmask_scan_avx2(const unsigned int *prefix, const size_t positions, const unsigned int window)
+{
+	const __m256i nibble_bits = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+	                                             0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i low = _mm256_set1_epi8(0x0f);
+	const __m256i ones8 = _mm256_set1_epi8(1);
+	const __m256i ones16 = _mm256_set1_epi16(1);
+	const __m256i w = _mm256_set1_epi32(window);
+	__m256i x, cnt;
+	size_t p;
+	int bits;
+	long tail;
+
+	for (p = 0; p + 8 <= positions; p += 8)
+	{
+		x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(prefix + p + window)),
+		                     _mm256_loadu_si256((const __m256i*)(prefix + p)));
+
+		// Bits per byte from a nibble table, then summed up per 32 bit lane
+		cnt = _mm256_add_epi8(_mm256_shuffle_epi8(nibble_bits, _mm256_and_si256(x, low)),
+		                      _mm256_shuffle_epi8(nibble_bits, _mm256_and_si256(_mm256_srli_epi16(x, 4), low)));
+		cnt = _mm256_madd_epi16(_mm256_maddubs_epi16(cnt, ones8), ones16);
+
+		bits = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(cnt, w)));
+		if (bits)
+			return p + __builtin_ctz(bits);
+	}
+
+	tail = bitmask_scan_scalar(prefix + p, positions - p, window);
+	return tail < 0 ? -1 : (long)p + tail;
+}
+#endif
+
+typedef long (*Bitmask_scan)(const unsigned int*, const size_t, const unsigned int);
+
+/*
+ * Pick the widest kernel the CPU supports at runtime.
+ */
+Bitmask_scan bitmask_select_scan(void)
+{
+#ifdef HAVE_X86_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return bitmask_scan_avx2;
+	if (__builtin_cpu_supports("sse2"))
+		return bitmask_scan_sse2;
+#endif
+	return bitmask_scan_scalar;
 }
 
-int Elfstream_get_start_of_pack_marker(Elfstream es)
+/*
+ * Prefix builders for the bitmask kernels, prefix[i+1] = prefix[i] ^ (1 <<
+ * (buf[i] - 'a')) for i in [0, n), starting from the value already in
+ * prefix[0]. The vector versions take 16 bytes per iteration, turn 4 (SSE2)
+ * or 8 (AVX2) letters at a time into their masks and build the prefix XOR
+ * inside the register in log steps: XOR with the register shifted by one
+ * lane, then by two lanes (AVX2 also carries the low 128 bit half into the
+ * high one) and finally with the running prefix of the previous register.
+ *
+ * Return: Non zero if one of the bytes is not a lower case letter, the
+ * prefix is undefined then.
+ */
+int bitmask_prefix_scalar(const char *buf, const size_t n, unsigned int *prefix)
 {
-	char cblock[4];
-	int c;
+	unsigned char ch, bad;
+	size_t i;
 
-	for (c = 4; c < es->len; ++c)
+	bad = 0;
+	for (i = 0; i < n; ++i)
 	{
-		memcpy(cblock, es->buf+c-4, 4*sizeof(char));
-		if (Block_all_char_differ(4, cblock)) 
-			return c;
+		ch = (unsigned char)buf[i] - 'a';
+		bad |= ch >= 26;
+		prefix[i+1] = prefix[i] ^ (1u << (ch & 31));
 	}
+	return bad;
 }
 
-int Elfstream_get_start_of_message_marker(Elfstream es)
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("sse2")))
+int bitmask_prefix_sse2(const char *buf, const size_t n, unsigned int *prefix)
 {
-	char cblock[14];
-	int c;
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i last_letter = _mm_set1_epi8(25);
+	__m128i v, half, x, run, bad;
+	size_t i;
+	int q;
 
-	for (c = 14; c < es->len; ++c)
+	run = _mm_set1_epi32(prefix[0]);
+	bad = zero;
+	for (i = 0; i + 16 <= n; i += 16)
 	{
-		memcpy(cblock, es->buf+c-14, 14*sizeof(char));
-		if (Block_all_char_differ(14, cblock)) 
-			return c;
+		// Letter numbers as unsigned bytes, anything but a-z ends up above 25
+		v = _mm_sub_epi8(_mm_loadu_si128((const __m128i*)(buf + i)), _mm_set1_epi8('a'));
+		bad = _mm_max_epu8(bad, v);
+
+		for (q = 0; q < 4; ++q)
+		{
+			half = q < 2 ? _mm_unpacklo_epi8(v, zero) : _mm_unpackhi_epi8(v, zero);
+			x = q % 2 == 0 ? _mm_unpacklo_epi16(half, zero) : _mm_unpackhi_epi16(half, zero);
+
+			// 1 << c as the float 2^c, i.e. biased exponent c + 127 and no mantissa
+			x = _mm_cvttps_epi32(_mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(x, _mm_set1_epi32(127)), 23)));
+
+			x = _mm_xor_si128(x, _mm_slli_si128(x, 4));
+			x = _mm_xor_si128(x, _mm_slli_si128(x, 8));
+			x = _mm_xor_si128(x, run);
+			_mm_storeu_si128((__m128i*)(prefix + i + 4 * q + 1), x);
+			run = _mm_shuffle_epi32(x, 0xff);
+		}
 	}
+
+	if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(bad, last_letter), last_letter)) != 0xffff)
+		return 1;
+	return bitmask_prefix_scalar(buf + i, n - i, prefix + i);
 }
 
+__attribute__((target("avx2")))
+int bitmask_prefix_avx2(const char *buf, const size_t n, unsigned int *prefix)
+{
+	const __m256i one = _mm256_set1_epi32(1);
+	const __m256i top = _mm256_set1_epi32(7);
+	const __m128i last_letter = _mm_set1_epi8(25);
+	__m128i v, bad;
+	__m256i x, run;
+	size_t i;
+	int q;
+
+	run = _mm256_set1_epi32(prefix[0]);
+	bad = _mm_setzero_si128();
+	for (i = 0; i + 16 <= n; i += 16)
+	{
+		// Letter numbers as unsigned bytes, anything but a-z ends up above 25
+		v = _mm_sub_epi8(_mm_loadu_si128((const __m128i*)(buf + i)), _mm_set1_epi8('a'));
+		bad = _mm_max_epu8(bad, v);
+
+		for (q = 0; q < 2; ++q)
+		{
+			x = _mm256_sllv_epi32(one, _mm256_cvtepu8_epi32(q == 0 ? v : _mm_srli_si128(v, 8)));
+
+			x = _mm256_xor_si256(x, _mm256_slli_si256(x, 4));
+			x = _mm256_xor_si256(x, _mm256_slli_si256(x, 8));
+			x = _mm256_xor_si256(x, _mm256_permute2x128_si256(_mm256_shuffle_epi32(x, 0xff), x, 0x08));
+			x = _mm256_xor_si256(x, run);
+			_mm256_storeu_si256((__m256i*)(prefix + i + 8 * q + 1), x);
+			run = _mm256_permutevar8x32_epi32(x, top);
+		}
+	}
+
+	if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(bad, last_letter), last_letter)) != 0xffff)
+		return 1;
+	return bitmask_prefix_scalar(buf + i, n - i, prefix + i);
+}
+#endif
+
+typedef int (*Bitmask_prefix)(const char*, const size_t, unsigned int*);
+
+/*
+ * Pick the widest prefix builder the CPU supports at runtime.
+ */
+Bitmask_prefix bitmask_select_prefix(void)
+{
+#ifdef HAVE_X86_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return bitmask_prefix_avx2;
+	if (__builtin_cpu_supports("sse2"))
+		return bitmask_prefix_sse2;
+#endif
+	return bitmask_prefix_scalar;
+}
+
+/*
+ * Find the first marker of a short window (1 to BITMASK_MAX_WINDOW) with
+ * the bitmask kernels. The prefix XOR of the letter masks is built in
+ * blocks of BITMASK_BLOCK start positions.
+ *
+ * Return: The end position of the first marker, -1 if there is none or -2
+ * if the kernel does not apply (window too large or a byte before the
+ * marker is not a lower case letter).
+ */
+long Elfstream_find_marker_bitmask(const Elfstream es, const unsigned int window)
+{
+	static Bitmask_scan scan = NULL;
+	static Bitmask_prefix build = NULL;
+	unsigned int prefix[BITMASK_BLOCK + BITMASK_MAX_WINDOW];
+	size_t base, positions;
+	long p;
+
+	if (window == 0)
+		return 0;
+	if (window > BITMASK_MAX_WINDOW)
+		return -2;
+	if (scan == NULL)
+	{
+		scan = bitmask_select_scan();
+		build = bitmask_select_prefix();
+	}
+
+	for (base = 0; base + window <= es->len; base += BITMASK_BLOCK)
+	{
+		positions = es->len - window + 1 - base;
+		if (positions > BITMASK_BLOCK)
+			positions = BITMASK_BLOCK;
+
+		prefix[0] = 0;
+		if (build(es->buf + base, positions + window - 1, prefix))
+			return -2;
+
+		p = scan(prefix, positions, window);
+		if (p >= 0)
+			return base + p + window;
+	}
+	return -1;
+}
+
+/*
+ * Use the bitmask kernel where it applies and the generic sliding window
+ * otherwise.
+ */
+long Elfstream_find_marker_fast(const Elfstream es, const unsigned int window)
+{
+	long marker = Elfstream_find_marker_bitmask(es, window);
+
+	return marker == -2 ? Elfstream_find_marker(es, window) : marker;
+}
+
+double seconds_since(const struct timespec *t0)
+{
+	struct timespec t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return (t1.tv_sec - t0->tv_sec) + 1e-9 * (t1.tv_nsec - t0->tv_nsec);
+}
+
+/*
+ * Throughput of the generic sliding window and the bitmask kernel on
+ * datastreams of len random lower case letters. For a window w the letters
+ * are drawn from w-1 letters, so there is no marker and the whole stream is
+ * scanned.
+ */
+void Elfstream_benchmark(const size_t len)
+{
+	const unsigned int windows[] = { 4, 8, 14, 16 };
+	struct timespec t0;
+	Elfstream es;
+	double t_generic, t_bitmask;
+	long m_generic, m_bitmask;
+	unsigned int w;
+	size_t i;
+
+	Elfstream_create(&es);
+	es->len = len;
+	es->buf = (char*)malloc( (len + 1) * sizeof(char) );
+	es->buf[len] = '\0';
+
+	srand(2022);
+	for (w = 0; w < sizeof(windows) / sizeof(windows[0]); ++w)
+	{
+		for (i = 0; i < len; ++i)
+			es->buf[i] = 'a' + rand() % (windows[w] - 1);
+
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		m_generic = Elfstream_find_marker(es, windows[w]);
+		t_generic = seconds_since(&t0);
+
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		m_bitmask = Elfstream_find_marker_bitmask(es, windows[w]);
+		t_bitmask = seconds_since(&t0);
+
+		printf("window %2u: generic %8.1f MB/s, bitmask %8.1f MB/s (markers %ld / %ld)\n", windows[w],
+			len / t_generic * 1e-6, len / t_bitmask * 1e-6, m_generic, m_bitmask);
+	}
+
+	Elfstream_destroy(&es);
+}
+
+/*
+ * Incremental marker detector for a live feed. The datastream is pushed in
+ * slices of any size and the sliding window state of
+ * Elfstream_find_markers() is kept across the calls, with positions counted
+ * from the start of the feed. The memory does not depend on the length of
+ * the feed.
+ */
+typedef struct Elfdetector_p *Elfdetector;
+
+struct Elfdetector_p
+{
+	unsigned int window;
+	size_t offset;
+	size_t start;
+	size_t last[256];
+	long marker;
+};
+
+void Elfdetector_create(Elfdetector *det, const unsigned int window)
+{
+	*det = NULL;
+	*det = (struct Elfdetector_p*)malloc( sizeof(struct Elfdetector_p) );
+	if (*det == NULL)
+	{
+		perror("Failed to create Elfdetector\n");
+		return;
+	}
+
+	(*det)->window = window;
+	(*det)->offset = 0;
+	(*det)->start = 0;
+	// last[] holds positions + 1, so 0 means not seen
+	memset((*det)->last, 0, sizeof((*det)->last));
+	(*det)->marker = window == 0 ? 0 : -1;
+}
+
+void Elfdetector_destroy(Elfdetector *det)
+{
+	free(*det);
+	*det = NULL;
+}
+
+/*
+ * Feed the next len bytes of the datastream to the detector. The slice is
+ * only scanned up to the end of the marker.
+ *
+ * Return: The end position of the first marker, counted from the start of
+ * the feed, as soon as it has been seen, or -1 if there is none yet.
+ */
+long Elfdetector_push(Elfdetector det, const char *slice, const size_t len)
+{
+	size_t i, c;
+	unsigned char ch;
+
+	if (det->marker >= 0)
+		return det->marker;
+
+	for (i = 0; i < len; ++i)
+	{
+		c = det->offset + i;
+		ch = (unsigned char)slice[i];
+		if (det->last[ch] > det->start)
+			det->start = det->last[ch];
+		det->last[ch] = c + 1;
+
+		if (c + 1 - det->start >= det->window)
+		{
+			det->marker = c + 1;
+			break;
+		}
+	}
+	det->offset += i < len ? i + 1 : len;
+
+	return det->marker;
+}
+
+/*
+ * Read the datastream from stdin as it arrives and report every marker as
+ * soon as its detector sees it. Reading stops at the first line break, at
+ * the end of the input or once all markers have been found.
+ */
+void Elfdetector_run_stdin(const unsigned int n, const unsigned int *windows, long *markers)
+{
+	Elfdetector *det;
+	char buf[4096];
+	char *nl;
+	ssize_t len;
+	unsigned int w, found;
+
+	det = (Elfdetector*)malloc( n * sizeof(Elfdetector) );
+	found = 0;
+	for (w = 0; w < n; ++w)
+	{
+		Elfdetector_create(&det[w], windows[w]);
+		markers[w] = det[w]->marker;
+		if (markers[w] >= 0)
+			found++;
+	}
+
+	while (found < n && (len = read(STDIN_FILENO, buf, sizeof(buf))) > 0)
+	{
+		nl = (char*)memchr(buf, '\n', len);
+		if (nl != NULL)
+			len = nl - buf;
+
+		for (w = 0; w < n; ++w)
+		{
+			if (markers[w] >= 0)
+				continue;
+
+			markers[w] = Elfdetector_push(det[w], buf, len);
+			if (markers[w] >= 0)
+			{
+				printf("Marker of window %u at: %ld\n", windows[w], markers[w]);
+				fflush(stdout);
+				found++;
+			}
+		}
+
+		if (nl != NULL)
+			break;
+	}
+
+	for (w = 0; w < n; ++w)
+		Elfdetector_destroy(&det[w]);
+	free(det);
+}
+
+/*
+ * Usage: tuning-trouble [-j <threads> | -x] <file> [window ...]
+ *        tuning-trouble -b <bytes>
+ *
+ * Additional window sizes are searched together with the two puzzle markers
+ * in one pass over the datastream. With -j each window is searched by
+ * Elfstream_find_marker_parallel() instead. If the file is "-" the
+ * datastream is read from stdin and the markers are reported as they
+ * arrive, see Elfdetector_run_stdin(). With -x every window is searched by
+ * Elfstream_find_marker_fast(), -b runs the kernel benchmark.
+ */
 int main(int argc, char **argv)
 {
 	Elfstream es;
-	int start_of_pack_marker, start_of_message_marker;
+	unsigned int *windows;
+	long *markers;
+	int w, arg, threads, bitmask;
+
+	arg = 1;
+	threads = 0;
+	bitmask = 0;
+	if (argc > 2 && strcmp(argv[1], "-b") == 0)
+	{
+		Elfstream_benchmark(strtoul(argv[2], NULL, 10));
+		return 0;
+	}
+	else if (argc > 2 && strcmp(argv[1], "-j") == 0)
+	{
+		threads = atoi(argv[2]);
+		arg += 2;
+	}
+	else if (argc > 1 && strcmp(argv[1], "-x") == 0)
+	{
+		bitmask = 1;
+		arg++;
+	}
 
-	if (argc < 2)
+	if (argc - arg < 1)
 	{
 		perror("Not enough input arguments.\n");
 		return 1;
 	}
 	else 
 	{
+		// Drop the options, argv[1] is the file name from here on
+		argc -= arg - 1;
+		argv += arg - 1;
+
+		// Part 1 and 2 plus the additional windows
+		windows = (unsigned int*)malloc( argc * sizeof(unsigned int) );
+		markers = (long*)malloc( argc * sizeof(long) );
+		windows[0] = 4;
+		windows[1] = 14;
+		for (w = 2; w < argc; ++w)
+			windows[w] = atoi(argv[w]);
+
+		if (strcmp(argv[1], "-") == 0)
+		{
+			Elfdetector_run_stdin(argc, windows, markers);
+			free(markers);
+			free(windows);
+			return 0;
+		}
+
 		Elfstream_create(&es);
 
 		Elfstream_read_from_file(argv[1], es);
 
-		// Part 1
-		start_of_pack_marker = Elfstream_get_start_of_pack_marker(es);
-		printf("Start of pack marker at: %d\n", start_of_pack_marker);
-		
-		// Part 2
-		start_of_message_marker = Elfstream_get_start_of_message_marker(es);
-		printf("Start of message marker at: %d\n", start_of_message_marker);
+		if (threads > 0)
+			for (w = 0; w < argc; ++w)
+				markers[w] = Elfstream_find_marker_parallel(es, windows[w], threads);
+		else if (bitmask)
+			for (w = 0; w < argc; ++w)
+				markers[w] = Elfstream_find_marker_fast(es, windows[w]);
+		else
+			Elfstream_find_markers(es, argc, windows, markers);
+
+		printf("Start of pack marker at: %ld\n", markers[0]);
+		printf("Start of message marker at: %ld\n", markers[1]);
+		for (w = 2; w < argc; ++w)
+			printf("Marker of window %u at: %ld\n", windows[w], markers[w]);
+
+		free(markers);
+		free(windows);
 
 		Elfstream_destroy(&es);
 	}
@@ -4,9 +4,25 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
 
 const size_t MAX_LINE_LENGTH = 32;
-const size_t MAX_LOCATIONS = 1E4;
+const size_t INITIAL_LOCATIONS = 1024;
+const unsigned int RADIX_DIGIT_BITS = 11;
+const size_t MIN_SORT_CHUNK = 1 << 16;
+const char FREQUENCY_INDEX_MAGIC[8] = "LOCIDX1";
+const unsigned int MIN_FREQUENCY_INDEX_BITS = 4;
 
 typedef unsigned int ErrorCode;
 
@@ -18,6 +34,8 @@ struct LocationPairList_p
   unsigned int *locationID1;
   unsigned int *locationID2;
   size_t n_locations;
+  size_t capacity;
+  unsigned int columns;
 };
 
 ErrorCode
@@ -36,6 +54,8 @@ LocationPairList_create(LocationPairList *ll)
   (*ll)->locationID1 = NULL;
   (*ll)->locationID2 = NULL;
   (*ll)->n_locations = 0;
+  (*ll)->capacity = 0;
+  (*ll)->columns = 2;
 
   return EXIT_SUCCESS;
 }
@@ -57,10 +77,102 @@ LocationPairList_destroy(LocationPairList *ll)
   return EXIT_SUCCESS;
 }
 
+/*
+ * Grows the ID columns to hold at least capacity entries. The capacity is
+ * doubled so that n appends cost amortized O(n). A list with a single
+ * column only has locationID1.
+ */
+ErrorCode
+LocationPairList_reserve(LocationPairList ll, size_t capacity)
+{
+  size_t new_capacity = ll->capacity > 0 ? ll->capacity : INITIAL_LOCATIONS;
+  unsigned int *id1;
+  unsigned int *id2;
+
+  if (capacity <= ll->capacity)
+  {
+    return EXIT_SUCCESS;
+  }
+
+  while (new_capacity < capacity)
+  {
+    new_capacity *= 2;
+  }
+
+  id1 = (unsigned int *)realloc( ll->locationID1, new_capacity * sizeof(unsigned int) );
+  if (id1 == NULL)
+  {
+    perror("Failed to grow location list.\n");
+    return EXIT_FAILURE;
+  }
+  ll->locationID1 = id1;
+  ll->allocated = true;
+
+  if (ll->columns > 1)
+  {
+    id2 = (unsigned int *)realloc( ll->locationID2, new_capacity * sizeof(unsigned int) );
+    if (id2 == NULL)
+    {
+      perror("Failed to grow location list.\n");
+      return EXIT_FAILURE;
+    }
+    ll->locationID2 = id2;
+  }
+
+  ll->capacity = new_capacity;
+
+  return EXIT_SUCCESS;
+}
+
+/*
+ * Reads one location ID from *p and advances *p past it. Leading blanks are
+ * skipped.
+ * Return: false if no number is found or it does not fit an unsigned int.
+ */
+_Bool
+parse_location_id(const char **p, unsigned int *id)
+{
+  const char *c = *p;
+  unsigned long long value = 0;
+
+  while (*c == ' ' || *c == '\t')
+  {
+    ++c;
+  }
+
+  if (*c < '0' || *c > '9')
+  {
+    return false;
+  }
+
+  while (*c >= '0' && *c <= '9')
+  {
+    value = value * 10 + (unsigned long long)(*c - '0');
+    if (value > UINT_MAX)
+    {
+      return false;
+    }
+    ++c;
+  }
+
+  *id = (unsigned int)value;
+  *p = c;
+
+  return true;
+}
+
+/*
+ * Reads columns (1 or 2) columns of location IDs in a single pass. The
+ * columns grow as needed, so there is no limit on the number of lines.
+ * Empty lines are skipped, malformed lines are reported as errors. With a
+ * single column only the left list is read, anything behind the first ID of
+ * a line is ignored.
+ */
 ErrorCode
 LocationPairList_read_from_file(LocationPairList ll, 
                                 const char *filename, 
-                                const unsigned int length)
+                                const unsigned int length,
+                                const unsigned int columns)
 {
   // Ensure that the input for the file name has the correct length.
   assert(strlen(filename) == length);
@@ -77,153 +189,566 @@ LocationPairList_read_from_file(LocationPairList ll,
   else 
   {
     printf("Reading LocationPairList form file %s\n", filename);
-      
 
-    // Count numbe rof entries
+    clock_t start = clock();
+    size_t n_bytes = 0;
+    size_t line = 0;
+
     ll->n_locations = 0;
+    ll->columns = columns;
     while (fgets(buf, MAX_LINE_LENGTH, fp) != NULL)
     {
-        ll->n_locations++;
-       
-        // Prevent runaway code
-        if (ll->n_locations > MAX_LOCATIONS)
-        {
-          break;
-        }
+      const char *p = buf;
+      size_t line_length = strlen(buf);
+
+      n_bytes += line_length;
+      ++line;
+
+      if (buf[line_length-1] != '\n' && !feof(fp))
+      {
+        fprintf(stderr, "Line %zu of %s is too long.\n", line, filename);
+        fclose(fp);
+        return EXIT_FAILURE;
+      }
+
+      if (buf[0] == '\n' || (buf[0] == '\r' && buf[1] == '\n'))
+      {
+        continue;
+      }
+
+      if (LocationPairList_reserve(ll, ll->n_locations + 1) != EXIT_SUCCESS)
+      {
+        fclose(fp);
+        return EXIT_FAILURE;
+      }
+
+      if (!parse_location_id(&p, &ll->locationID1[ll->n_locations]) ||
+          (columns > 1 && !parse_location_id(&p, &ll->locationID2[ll->n_locations])))
+      {
+        fprintf(stderr, "Failed to parse line %zu of %s.\n", line, filename);
+        fclose(fp);
+        return EXIT_FAILURE;
+      }
+
+      ll->n_locations++;
     }
 
+    double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+
     printf("Locatoin count: %zu\n", ll->n_locations);
+    if (seconds > 0)
+    {
+      printf("Ingest: %zu bytes in %.3f s (%.1f MB/s)\n",
+             n_bytes, seconds, n_bytes / seconds / 1E6);
+    }
+
+    return fclose(fp);
+  }
+}
+
+/*
+ * LSD radix sort of unsigned IDs with digits of digit_bits bits (8, 11 or
+ * 16). Each pass is a stable counting sort between list and scratch, which
+ * must hold size entries and can be shared between calls. Only as many
+ * passes as needed for the largest ID are done, and passes where all IDs
+ * have the same digit are skipped. Runs in O(passes * (size + 2^digit_bits))
+ * time independent of the order of the input.
+ */
+ErrorCode
+radix_sort(unsigned int *list, unsigned int *scratch, size_t size, unsigned int digit_bits)
+{
+  const size_t buckets = (size_t)1 << digit_bits;
+  const unsigned int digit_mask = buckets - 1;
+  unsigned int *src = list;
+  unsigned int *dst = scratch;
+  unsigned int *tmp;
+  unsigned int max_id = 0;
+  size_t *count;
+
+  if (digit_bits == 0 || digit_bits > 16)
+  {
+    fprintf(stderr, "Radix digit size of %u bits is not supported.\n", digit_bits);
+    return EXIT_FAILURE;
+  }
+
+  count = (size_t *)malloc( buckets * sizeof(size_t) );
+  if (count == NULL)
+  {
+    perror("Failed to allocate radix counters.\n");
+    return EXIT_FAILURE;
+  }
 
-    ll->locationID1 = (unsigned int *)malloc( ll->n_locations * sizeof(unsigned int) );
-    ll->locationID2 = (unsigned int *)malloc( ll->n_locations * sizeof(unsigned int) );
+  for (size_t i = 0; i < size; ++i)
+  {
+    if (list[i] > max_id) max_id = list[i];
+  }
 
-    ll->allocated = true;
+  for (unsigned int shift = 0; shift < 32 && (max_id >> shift) != 0; shift += digit_bits)
+  {
+    memset(count, 0, buckets * sizeof(size_t));
 
-    rewind(fp);
-    
-    for (unsigned int i = 0; i < ll->n_locations; ++i)
+    for (size_t i = 0; i < size; ++i)
     {
-      fgets(buf, MAX_LINE_LENGTH, fp);
+      count[(src[i] >> shift) & digit_mask]++;
+    }
 
-      sscanf(buf, "%d %d", &ll->locationID1[i], &ll->locationID2[i]);
+    // All IDs share this digit, nothing to do
+    if (count[(src[0] >> shift) & digit_mask] == size)
+    {
+      continue;
     }
 
-    return fclose(fp);
+    // Exclusive prefix sum gives the first output index of each bucket
+    size_t offset = 0;
+    for (size_t b = 0; b < buckets; ++b)
+    {
+      size_t c = count[b];
+      count[b] = offset;
+      offset += c;
+    }
+
+    for (size_t i = 0; i < size; ++i)
+    {
+      dst[count[(src[i] >> shift) & digit_mask]++] = src[i];
+    }
+
+    tmp = src;
+    src = dst;
+    dst = tmp;
+  }
+
+  if (src != list)
+  {
+    memcpy(list, src, size * sizeof(unsigned int));
+  }
+
+  free(count);
+
+  return EXIT_SUCCESS;
+}
+
+
+struct SortChunk
+{
+  unsigned int *list;
+  unsigned int *scratch;
+  size_t size;
+  unsigned int threads;
+  ErrorCode status;
+};
+
+struct MergeChunk
+{
+  const unsigned int *a;
+  size_t na;
+  const unsigned int *b;
+  size_t nb;
+  unsigned int *out;
+};
+
+void *
+radix_sort_chunk(void *arg)
+{
+  struct SortChunk *chunk = (struct SortChunk *)arg;
+
+  chunk->status = radix_sort(chunk->list, chunk->scratch, chunk->size, RADIX_DIGIT_BITS);
+
+  return NULL;
+}
+
+/*
+ * Merge path split: returns how many entries of a are among the first diag
+ * entries of the merge of a and b. Runs in O(log(min(na, nb))).
+ */
+size_t
+merge_split(const unsigned int *a, size_t na, const unsigned int *b, size_t nb, size_t diag)
+{
+  size_t lo = diag > nb ? diag - nb : 0;
+  size_t hi = diag < na ? diag : na;
+
+  while (lo < hi)
+  {
+    size_t mid = lo + (hi - lo) / 2;
+
+    if (a[mid] <= b[diag - mid - 1])
+    {
+      lo = mid + 1;
+    }
+    else
+    {
+      hi = mid;
+    }
+  }
+
+  return lo;
+}
+
+void *
+merge_chunk(void *arg)
+{
+  struct MergeChunk *chunk = (struct MergeChunk *)arg;
+  const unsigned int *a = chunk->a;
+  const unsigned int *b = chunk->b;
+  const unsigned int *a_end = a + chunk->na;
+  const unsigned int *b_end = b + chunk->nb;
+  unsigned int *out = chunk->out;
+
+  while (a < a_end && b < b_end)
+  {
+    *out++ = *b < *a ? *b++ : *a++;
+  }
+
+  while (a < a_end)
+  {
+    *out++ = *a++;
+  }
+
+  while (b < b_end)
+  {
+    *out++ = *b++;
   }
+
+  return NULL;
 }
 
-/* 
- * I used the non-recursive merge sort algorithm from Rama Hoetzlein anser on
- * https://stackoverflow.com/questions/1557894/non-recursive-merge-sort
- * a similar version can be found on 
- * https://algorithmist.com/wiki/Merge_sort.c
+/*
+ * Parallel sort of a single list on up to threads threads. The list is cut
+ * into one chunk per thread and every chunk is radix sorted on its own
+ * thread. The sorted runs are then merged pairwise, round after round,
+ * between list and scratch. Every merge is cut into parts with merge_split()
+ * so that each round keeps all threads busy, including the last one with a
+ * single pair. Small lists and threads <= 1 fall back to radix_sort().
  */
 ErrorCode
-merge_sort(int *list, size_t size)
+parallel_sort(unsigned int *list, unsigned int *scratch, size_t size, unsigned int threads)
 {
-  int tmp[size];
-  unsigned int right, right_end;
-  unsigned int i, j, m;
+  ErrorCode status = EXIT_SUCCESS;
+  pthread_t *tids;
+  struct SortChunk *sort_chunks;
+  struct MergeChunk *merge_chunks;
+  size_t *bounds;
+  _Bool *joinable;
+  unsigned int *src = list;
+  unsigned int *dst = scratch;
+  unsigned int *tmp;
+  unsigned int runs;
+
+  if (threads > size / MIN_SORT_CHUNK)
+  {
+    threads = size / MIN_SORT_CHUNK;
+  }
+
+  if (threads <= 1)
+  {
+    return radix_sort(list, scratch, size, RADIX_DIGIT_BITS);
+  }
 
-  for (unsigned int k = 1; k < size; k *= 2)
+  tids = (pthread_t *)malloc( (threads + 1) * sizeof(pthread_t) );
+  sort_chunks = (struct SortChunk *)malloc( threads * sizeof(struct SortChunk) );
+  merge_chunks = (struct MergeChunk *)malloc( (threads + 1) * sizeof(struct MergeChunk) );
+  bounds = (size_t *)malloc( (threads + 1) * sizeof(size_t) );
+  joinable = (_Bool *)malloc( (threads + 1) * sizeof(_Bool) );
+  if (tids == NULL || sort_chunks == NULL || merge_chunks == NULL ||
+      bounds == NULL || joinable == NULL)
   {
-    for (unsigned int left = 0; left + k < size; left += 2 * k)
+    perror("Failed to allocate parallel sort.\n");
+    free(tids);
+    free(sort_chunks);
+    free(merge_chunks);
+    free(bounds);
+    free(joinable);
+    return EXIT_FAILURE;
+  }
+
+  // Phase 1: Sort one chunk per thread
+  for (unsigned int t = 0; t <= threads; ++t)
+  {
+    bounds[t] = size / threads * t + (size % threads) * t / threads;
+  }
+
+  for (unsigned int t = 0; t < threads; ++t)
+  {
+    sort_chunks[t].list = list + bounds[t];
+    sort_chunks[t].scratch = scratch + bounds[t];
+    sort_chunks[t].size = bounds[t+1] - bounds[t];
+    sort_chunks[t].status = EXIT_FAILURE;
+
+    // Sort on the calling thread if no new thread can be started
+    joinable[t] = pthread_create(&tids[t], NULL, radix_sort_chunk, &sort_chunks[t]) == 0;
+    if (!joinable[t])
     {
-      right = left + k;
-      right_end = right + k;
-      if (right_end > size) right_end = size;
-      m = i = left;
-      j = right;
+      radix_sort_chunk(&sort_chunks[t]);
+    }
+  }
 
-      while (i < right && j < right_end)
-      {
-        if (list[i] <= list[j])
-        {
-          tmp[m] = list[i];
-          ++i;
-        }
-        else 
-        {
-          tmp[m] = list[j];
-          ++j;
-        }
-        ++m;
-      }
+  for (unsigned int t = 0; t < threads; ++t)
+  {
+    if (joinable[t])
+    {
+      pthread_join(tids[t], NULL);
+    }
+    if (sort_chunks[t].status != EXIT_SUCCESS)
+    {
+      status = EXIT_FAILURE;
+    }
+  }
+
+  // Phase 2: Merge pairs of runs until a single run is left
+  runs = threads;
+  while (status == EXIT_SUCCESS && runs > 1)
+  {
+    const unsigned int pairs = runs / 2;
+    const unsigned int parts = threads / pairs;
+    unsigned int n_tasks = 0;
 
-      while (i < right)
+    for (unsigned int r = 0; r + 1 < runs; r += 2)
+    {
+      const unsigned int *a = src + bounds[r];
+      const unsigned int *b = src + bounds[r+1];
+      const size_t na = bounds[r+1] - bounds[r];
+      const size_t nb = bounds[r+2] - bounds[r+1];
+      size_t ia = 0;
+      size_t ib = 0;
+
+      for (unsigned int k = 1; k <= parts; ++k)
       {
-        tmp[m] = list[i];
-        ++i; ++m;
+        const size_t diag = k == parts ? na + nb : (na + nb) / parts * k;
+        const size_t i = merge_split(a, na, b, nb, diag);
+
+        merge_chunks[n_tasks].a = a + ia;
+        merge_chunks[n_tasks].na = i - ia;
+        merge_chunks[n_tasks].b = b + ib;
+        merge_chunks[n_tasks].nb = diag - i - ib;
+        merge_chunks[n_tasks].out = dst + bounds[r] + ia + ib;
+        ++n_tasks;
+
+        ia = i;
+        ib = diag - i;
       }
+    }
+
+    // An odd run out is carried over as is
+    if (runs % 2 == 1)
+    {
+      merge_chunks[n_tasks].a = src + bounds[runs-1];
+      merge_chunks[n_tasks].na = bounds[runs] - bounds[runs-1];
+      merge_chunks[n_tasks].b = NULL;
+      merge_chunks[n_tasks].nb = 0;
+      merge_chunks[n_tasks].out = dst + bounds[runs-1];
+      ++n_tasks;
+    }
 
-      while (j < right_end)
+    for (unsigned int t = 0; t < n_tasks; ++t)
+    {
+      joinable[t] = pthread_create(&tids[t], NULL, merge_chunk, &merge_chunks[t]) == 0;
+      if (!joinable[t])
       {
-        tmp[m] = list[j];
-        ++j; ++m;
+        merge_chunk(&merge_chunks[t]);
       }
+    }
 
-      for (m = left; m < right_end; ++m)
+    for (unsigned int t = 0; t < n_tasks; ++t)
+    {
+      if (joinable[t])
       {
-        list[m] = tmp[m];
+        pthread_join(tids[t], NULL);
       }
     }
+
+    // Drop the boundaries between merged pairs
+    for (unsigned int r = 0; r <= runs; r += 2)
+    {
+      bounds[r / 2] = bounds[r];
+    }
+    if (runs % 2 == 1)
+    {
+      bounds[runs / 2 + 1] = bounds[runs];
+    }
+    runs = (runs + 1) / 2;
+
+    tmp = src;
+    src = dst;
+    dst = tmp;
   }
 
-  return EXIT_SUCCESS;
+  if (status == EXIT_SUCCESS && src != list)
+  {
+    memcpy(list, src, size * sizeof(unsigned int));
+  }
+
+  free(tids);
+  free(sort_chunks);
+  free(merge_chunks);
+  free(bounds);
+  free(joinable);
+
+  return status;
 }
 
+void *
+parallel_sort_column(void *arg)
+{
+  struct SortChunk *column = (struct SortChunk *)arg;
+
+  column->status = parallel_sort(column->list, column->scratch, column->size, column->threads);
+
+  return NULL;
+}
 
 /*
  * The sum of the distacnces between the entries of two list
  * is nothing else than the l1-norm of |u - v| with the two
  * vectors.
- * Here I used the implementation for two integer 
+ * The IDs are compared as unsigned values and the sum is kept in 64 bit.
  */
-int
-l1_error(int *u, int *v, size_t length)
+unsigned long long
+l1_error_scalar(const unsigned int *u, const unsigned int *v, size_t length)
 {
-  int s = 0;
+  unsigned long long s = 0;
 
   for (size_t i = 0; i < length; ++i)
   {
-    s += abs(u[i] - v[i]);
+    s += u[i] > v[i] ? u[i] - v[i] : v[i] - u[i];
   }
 
   return s;
 }
 
-/* To keep things easy here I did not really optimize the algorighm and went 
- * for the naive method. 
- * For each ID in left_list the complete right_list is searched
- * for identical IDs. The score then increases by the ID if the ID occurs in 
- * both lists.
- * The only optimization takes into account that both lists are sorted from
- * low to high IDs and the inner loop over the right IDs stops if the ID from
- * the left ist smaller than the ID from the right.
+#ifdef HAVE_X86_KERNELS
+/*
+ * SSE2 has no unsigned 32 bit compare, so the sign bits are flipped to
+ * compare signed, and u - v is negated in the lanes where v > u. The
+ * differences are widened to 64 bit before they are added up.
+ */
+__attribute__((target("sse2")))
+unsigned long long
+l1_error_sse2(const unsigned int *u, const unsigned int *v, size_t length)
+{
+  const __m128i sign = _mm_set1_epi32(INT_MIN);
+  const __m128i zero = _mm_setzero_si128();
+  __m128i sum = zero;
+  unsigned long long lanes[2];
+  size_t i;
+
+  for (i = 0; i + 4 <= length; i += 4)
+  {
+    __m128i a = _mm_loadu_si128((const __m128i *)(u + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(v + i));
+    __m128i neg = _mm_cmpgt_epi32(_mm_xor_si128(b, sign), _mm_xor_si128(a, sign));
+    __m128i d = _mm_sub_epi32(_mm_xor_si128(_mm_sub_epi32(a, b), neg), neg);
+
+    sum = _mm_add_epi64(sum, _mm_unpacklo_epi32(d, zero));
+    sum = _mm_add_epi64(sum, _mm_unpackhi_epi32(d, zero));
+  }
+
+  _mm_storeu_si128((__m128i *)lanes, sum);
+
+  return lanes[0] + lanes[1] + l1_error_scalar(u + i, v + i, length - i);
+}
+
+__attribute__((target("avx2")))
+unsigned long long
+l1_error_avx2(const unsigned int *u, const unsigned int *v, size_t length)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i sum0 = zero;
+  __m256i sum1 = zero;
+  unsigned long long lanes[4];
+  size_t i;
+
+  for (i = 0; i + 8 <= length; i += 8)
+  {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(u + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(v + i));
+    __m256i d = _mm256_sub_epi32(_mm256_max_epu32(a, b), _mm256_min_epu32(a, b));
+
+    sum0 = _mm256_add_epi64(sum0, _mm256_unpacklo_epi32(d, zero));
+    sum1 = _mm256_add_epi64(sum1, _mm256_unpackhi_epi32(d, zero));
+  }
+
+  _mm256_storeu_si256((__m256i *)lanes, _mm256_add_epi64(sum0, sum1));
+
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+         l1_error_scalar(u + i, v + i, length - i);
+}
+#endif
+
+typedef unsigned long long (*L1Kernel)(const unsigned int *, const unsigned int *, size_t);
+
+/*
+ * Pick the widest l1_error kernel the CPU supports at runtime.
+ */
+L1Kernel
+l1_select_kernel(void)
+{
+#ifdef HAVE_X86_KERNELS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+  {
+    return l1_error_avx2;
+  }
+  if (__builtin_cpu_supports("sse2"))
+  {
+    return l1_error_sse2;
+  }
+#endif
+  return l1_error_scalar;
+}
+
+unsigned long long
+l1_error(const unsigned int *u, const unsigned int *v, size_t length)
+{
+  return l1_select_kernel()(u, v, length);
+}
+
+
+/*
+ * Merge-join of the two sorted lists. Both lists are walked once; for every
+ * ID the runs of equal entries on the left and on the right are counted and
+ * the ID contributes left_count * right_count * ID to the score. IDs that
+ * occur in only one list are skipped. Runs in O(length) time.
  *
- * Defenately there is room for improvement.
+ * The score is accumulated in 64 bit since it easily exceeds unsigned int
+ * for large lists.
  */
-unsigned int
+unsigned long long
 similarity_socre(unsigned int *left_list, unsigned int *right_list, size_t length)
 {
-  unsigned int score = 0;
+  unsigned long long score = 0;
+  size_t i = 0;
+  size_t j = 0;
 
-  for (size_t i = 0; i < length; ++i)
+  while (i < length && j < length)
   {
     unsigned int left = left_list[i];
+    unsigned int right = right_list[j];
 
-    for (size_t j = 0; j < length; ++j)
+    if (left < right)
+    {
+      ++i;
+    }
+    else if (right < left)
+    {
+      ++j;
+    }
+    else
     {
-      unsigned int right = right_list[j];
+      size_t left_count = 0;
+      size_t right_count = 0;
 
-      if (left == right)
+      while (i < length && left_list[i] == left)
       {
-        score += left;
+        ++left_count;
+        ++i;
       }
-      else if (right > left)
+
+      while (j < length && right_list[j] == left)
       {
-        break;
+        ++right_count;
+        ++j;
       }
+
+      score += (unsigned long long)left * left_count * right_count;
     }
   }
 
@@ -231,42 +756,662 @@ similarity_socre(unsigned int *left_list, unsigned int *right_list, size_t lengt
 }
 
 
-int
-main(int argc, char **argv)
+/*
+ * Frequency index of the right list for repeated Part 2 queries. It is an
+ * open addressing hash table with linear probing that maps a location ID to
+ * the number of times it occurs. Slots with a count of zero are empty. The
+ * table is kept at most half full.
+ *
+ * On disk the index is a FrequencyIndexHeader followed by the slots, so a
+ * saved index can be mmapped and used as is.
+ */
+struct FrequencyIndexHeader
+{
+  char magic[8];
+  unsigned long long capacity;
+  unsigned long long n_ids;
+};
+
+struct FrequencyEntry
+{
+  unsigned int id;
+  unsigned int count;
+};
+
+typedef struct FrequencyIndex_p *FrequencyIndex;
+
+struct FrequencyIndex_p
+{
+  size_t capacity;
+  size_t n_ids;
+  unsigned int bits;
+  struct FrequencyEntry *entries;
+  void *map;
+  size_t map_size;
+};
+
+ErrorCode
+FrequencyIndex_create(FrequencyIndex *fi)
 {
-  if (argc < 2)
+  *fi = NULL;
+  *fi = (struct FrequencyIndex_p *)malloc( sizeof(struct FrequencyIndex_p) );
+  if (*fi == NULL)
   {
-    perror("Not enough input parameters.\n");
+    perror("Failed to create FrequencyIndex.\n");
     return EXIT_FAILURE;
   }
-  else 
-  {
-    LocationPairList location_list;
 
-    LocationPairList_create(&location_list);
+  (*fi)->capacity = 0;
+  (*fi)->n_ids = 0;
+  (*fi)->bits = 0;
+  (*fi)->entries = NULL;
+  (*fi)->map = NULL;
+  (*fi)->map_size = 0;
 
-    LocationPairList_read_from_file(location_list, 
-                                    argv[1], 
-                                    strlen(argv[1]));
+  return EXIT_SUCCESS;
+}
+
+ErrorCode
+FrequencyIndex_destroy(FrequencyIndex *fi)
+{
+  if (*fi != NULL)
+  {
+    if ((*fi)->map != NULL)
+    {
+      munmap((*fi)->map, (*fi)->map_size);
+    }
+    else
+    {
+      free((*fi)->entries);
+    }
+
+    free(*fi);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/*
+ * Fibonacci hashing, the top bits of the product select the home slot.
+ */
+size_t
+FrequencyIndex_slot(const FrequencyIndex fi, unsigned int id)
+{
+  return (size_t)(((unsigned long long)id * 0x9E3779B97F4A7C15ULL) >> (64 - fi->bits));
+}
+
+/*
+ * Return: The number of times id occurs in the indexed list.
+ *
+ * The probe visits every slot at most once, so a mapped index without an
+ * empty slot (a corrupt file) cannot loop forever.
+ */
+unsigned int
+FrequencyIndex_count(const FrequencyIndex fi, unsigned int id)
+{
+  const size_t mask = fi->capacity - 1;
+  size_t slot = FrequencyIndex_slot(fi, id);
+
+  for (size_t probe = 0; probe < fi->capacity && fi->entries[slot].count != 0; ++probe)
+  {
+    if (fi->entries[slot].id == id)
+    {
+      return fi->entries[slot].count;
+    }
+    slot = (slot + 1) & mask;
+  }
+
+  return 0;
+}
+
+/*
+ * Builds the index from a sorted list, every run of equal IDs becomes one
+ * slot.
+ */
+ErrorCode
+FrequencyIndex_build(FrequencyIndex fi, const unsigned int *sorted, size_t size)
+{
+  size_t n_ids = 0;
+
+  for (size_t i = 0; i < size; ++i)
+  {
+    if (i == 0 || sorted[i] != sorted[i-1])
+    {
+      ++n_ids;
+    }
+  }
+
+  fi->bits = MIN_FREQUENCY_INDEX_BITS;
+  while (((size_t)1 << fi->bits) < 2 * n_ids)
+  {
+    ++fi->bits;
+  }
+  fi->capacity = (size_t)1 << fi->bits;
+  fi->n_ids = n_ids;
+
+  fi->entries = (struct FrequencyEntry *)calloc( fi->capacity, sizeof(struct FrequencyEntry) );
+  if (fi->entries == NULL)
+  {
+    perror("Failed to allocate FrequencyIndex.\n");
+    return EXIT_FAILURE;
+  }
+
+  const size_t mask = fi->capacity - 1;
+
+  for (size_t i = 0; i < size; )
+  {
+    size_t run = i;
+    size_t slot = FrequencyIndex_slot(fi, sorted[i]);
+
+    while (run < size && sorted[run] == sorted[i])
+    {
+      ++run;
+    }
+
+    while (fi->entries[slot].count != 0)
+    {
+      slot = (slot + 1) & mask;
+    }
+
+    fi->entries[slot].id = sorted[i];
+    fi->entries[slot].count = (unsigned int)(run - i);
+
+    i = run;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+ErrorCode
+FrequencyIndex_save(const FrequencyIndex fi, const char *filename)
+{
+  struct FrequencyIndexHeader header;
+  FILE *fp = fopen(filename, "wb");
+
+  if (fp == NULL)
+  {
+    fprintf(stderr, "Failed to open index file %s.\n", filename);
+    return EXIT_FAILURE;
+  }
+
+  memcpy(header.magic, FREQUENCY_INDEX_MAGIC, sizeof(header.magic));
+  header.capacity = fi->capacity;
+  header.n_ids = fi->n_ids;
+
+  if (fwrite(&header, sizeof(header), 1, fp) != 1 ||
+      fwrite(fi->entries, sizeof(struct FrequencyEntry), fi->capacity, fp) != fi->capacity)
+  {
+    fprintf(stderr, "Failed to write index file %s.\n", filename);
+    fclose(fp);
+    return EXIT_FAILURE;
+  }
+
+  printf("Saved frequency index of %zu IDs to %s\n", fi->n_ids, filename);
+
+  return fclose(fp);
+}
+
+/*
+ * Maps a saved index read only into memory. The slots are used directly
+ * from the mapping, nothing is copied.
+ */
+ErrorCode
+FrequencyIndex_load(FrequencyIndex fi, const char *filename)
+{
+  const struct FrequencyIndexHeader *header;
+  struct stat st;
+  int fd = open(filename, O_RDONLY);
+
+  if (fd < 0)
+  {
+    fprintf(stderr, "Failed to open index file %s.\n", filename);
+    return EXIT_FAILURE;
+  }
+
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct FrequencyIndexHeader))
+  {
+    fprintf(stderr, "Index file %s is too short.\n", filename);
+    close(fd);
+    return EXIT_FAILURE;
+  }
+
+  fi->map_size = st.st_size;
+  fi->map = mmap(NULL, fi->map_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (fi->map == MAP_FAILED)
+  {
+    perror("Failed to map index file.\n");
+    fi->map = NULL;
+    return EXIT_FAILURE;
+  }
+
+  header = (const struct FrequencyIndexHeader *)fi->map;
+  fi->capacity = header->capacity;
+  fi->n_ids = header->n_ids;
+
+  fi->bits = 0;
+  while (fi->bits < 64 && ((size_t)1 << fi->bits) < fi->capacity)
+  {
+    ++fi->bits;
+  }
+
+  if (memcmp(header->magic, FREQUENCY_INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+      fi->bits < MIN_FREQUENCY_INDEX_BITS || fi->bits >= 64 ||
+      ((size_t)1 << fi->bits) != fi->capacity || fi->n_ids > fi->capacity / 2 ||
+      (fi->map_size - sizeof(struct FrequencyIndexHeader)) / sizeof(struct FrequencyEntry) != fi->capacity ||
+      (fi->map_size - sizeof(struct FrequencyIndexHeader)) % sizeof(struct FrequencyEntry) != 0)
+  {
+    fprintf(stderr, "%s is not a valid frequency index.\n", filename);
+    return EXIT_FAILURE;
+  }
+
+  fi->entries = (struct FrequencyEntry *)((char *)fi->map + sizeof(struct FrequencyIndexHeader));
+
+  printf("Loaded frequency index of %zu IDs from %s\n", fi->n_ids, filename);
+
+  return EXIT_SUCCESS;
+}
+
+/*
+ * Similarity score of an unsorted left list against the index, one lookup
+ * per left ID.
+ */
+unsigned long long
+FrequencyIndex_similarity_score(const FrequencyIndex fi, const unsigned int *left_list, size_t length)
+{
+  unsigned long long score = 0;
+
+  for (size_t i = 0; i < length; ++i)
+  {
+    score += (unsigned long long)left_list[i] * FrequencyIndex_count(fi, left_list[i]);
+  }
+
+  return score;
+}
+
+
+struct MergeL1Chunk
+{
+  struct MergeChunk column1;
+  struct MergeChunk column2;
+  size_t length;
+  unsigned long long l1;
+};
+
+/*
+ * Sets up chunk to produce the output positions [lo, hi) of the merge of the
+ * two sorted runs list[0, mid) and list[mid, size) into out.
+ */
+void
+merge_part(const unsigned int *list, size_t mid, size_t size,
+           size_t lo, size_t hi, unsigned int *out, struct MergeChunk *chunk)
+{
+  const size_t i_lo = merge_split(list, mid, list + mid, size - mid, lo);
+  const size_t i_hi = merge_split(list, mid, list + mid, size - mid, hi);
+
+  chunk->a = list + i_lo;
+  chunk->na = i_hi - i_lo;
+  chunk->b = list + mid + (lo - i_lo);
+  chunk->nb = (hi - i_hi) - (lo - i_lo);
+  chunk->out = out + lo;
+}
+
+/*
+ * Last merge of both columns in lock step. Every output position of the two
+ * columns is produced in the same iteration, so their distance is added up
+ * on the fly and the sorted columns need no further pass for Part 1.
+ */
+void *
+merge_l1_chunk(void *arg)
+{
+  struct MergeL1Chunk *chunk = (struct MergeL1Chunk *)arg;
+  const unsigned int *a1 = chunk->column1.a;
+  const unsigned int *b1 = chunk->column1.b;
+  const unsigned int *a1_end = a1 + chunk->column1.na;
+  const unsigned int *b1_end = b1 + chunk->column1.nb;
+  const unsigned int *a2 = chunk->column2.a;
+  const unsigned int *b2 = chunk->column2.b;
+  const unsigned int *a2_end = a2 + chunk->column2.na;
+  const unsigned int *b2_end = b2 + chunk->column2.nb;
+  unsigned int *out1 = chunk->column1.out;
+  unsigned int *out2 = chunk->column2.out;
+  unsigned long long s = 0;
+
+  for (size_t k = 0; k < chunk->length; ++k)
+  {
+    unsigned int x = b1 == b1_end || (a1 < a1_end && *a1 <= *b1) ? *a1++ : *b1++;
+    unsigned int y = b2 == b2_end || (a2 < a2_end && *a2 <= *b2) ? *a2++ : *b2++;
+
+    out1[k] = x;
+    out2[k] = y;
+    s += x > y ? x - y : y - x;
+  }
+
+  chunk->l1 = s;
+
+  return NULL;
+}
+
+/*
+ * Parallel sort of both columns with the sum of distances fused into the
+ * last merge. Each column is cut into two halves and all four halves are
+ * sorted at the same time by parallel_sort(), each on a quarter of the
+ * threads. The halves are then merged by merge_l1_chunk() into the scratch
+ * buffers, which become the new columns.
+ */
+ErrorCode
+sort_locations_fused(LocationPairList ll, unsigned int **scratch1, unsigned int **scratch2,
+                     unsigned int threads, unsigned long long *distance)
+{
+  ErrorCode status = EXIT_SUCCESS;
+  const size_t n = ll->n_locations;
+  const size_t h = n / 2;
+  struct SortChunk halves[4] = {
+    { ll->locationID1, *scratch1, h, (threads + 3) / 4, EXIT_FAILURE },
+    { ll->locationID1 + h, *scratch1 + h, n - h, (threads + 2) / 4, EXIT_FAILURE },
+    { ll->locationID2, *scratch2, h, (threads + 1) / 4, EXIT_FAILURE },
+    { ll->locationID2 + h, *scratch2 + h, n - h, threads / 4, EXIT_FAILURE }
+  };
+  unsigned int tasks = n / MIN_SORT_CHUNK;
+  pthread_t tids[4];
+  _Bool joinable[4];
+  pthread_t *merge_tids;
+  struct MergeL1Chunk *merge_chunks;
+  _Bool *merge_joinable;
+  unsigned int *tmp;
+
+  // Phase 1: Sort the four halves, the last one on the calling thread
+  for (unsigned int k = 0; k < 4; ++k)
+  {
+    joinable[k] = k < 3 && pthread_create(&tids[k], NULL, parallel_sort_column, &halves[k]) == 0;
+    if (!joinable[k])
+    {
+      parallel_sort_column(&halves[k]);
+    }
+  }
+
+  for (unsigned int k = 0; k < 4; ++k)
+  {
+    if (joinable[k])
+    {
+      pthread_join(tids[k], NULL);
+    }
+    if (halves[k].status != EXIT_SUCCESS)
+    {
+      status = EXIT_FAILURE;
+    }
+  }
+
+  if (status != EXIT_SUCCESS)
+  {
+    return status;
+  }
+
+  // Phase 2: Merge the halves of both columns and sum up the distances
+  if (tasks > threads)
+  {
+    tasks = threads;
+  }
+  if (tasks < 1)
+  {
+    tasks = 1;
+  }
+
+  merge_tids = (pthread_t *)malloc( tasks * sizeof(pthread_t) );
+  merge_chunks = (struct MergeL1Chunk *)malloc( tasks * sizeof(struct MergeL1Chunk) );
+  merge_joinable = (_Bool *)malloc( tasks * sizeof(_Bool) );
+  if (merge_tids == NULL || merge_chunks == NULL || merge_joinable == NULL)
+  {
+    perror("Failed to allocate parallel merge.\n");
+    free(merge_tids);
+    free(merge_chunks);
+    free(merge_joinable);
+    return EXIT_FAILURE;
+  }
+
+  for (unsigned int t = 0; t < tasks; ++t)
+  {
+    const size_t lo = n / tasks * t + (n % tasks) * t / tasks;
+    const size_t hi = n / tasks * (t + 1) + (n % tasks) * (t + 1) / tasks;
+
+    merge_part(ll->locationID1, h, n, lo, hi, *scratch1, &merge_chunks[t].column1);
+    merge_part(ll->locationID2, h, n, lo, hi, *scratch2, &merge_chunks[t].column2);
+    merge_chunks[t].length = hi - lo;
+
+    merge_joinable[t] = pthread_create(&merge_tids[t], NULL, merge_l1_chunk, &merge_chunks[t]) == 0;
+    if (!merge_joinable[t])
+    {
+      merge_l1_chunk(&merge_chunks[t]);
+    }
+  }
+
+  *distance = 0;
+  for (unsigned int t = 0; t < tasks; ++t)
+  {
+    if (merge_joinable[t])
+    {
+      pthread_join(merge_tids[t], NULL);
+    }
+    *distance += merge_chunks[t].l1;
+  }
+
+  free(merge_tids);
+  free(merge_chunks);
+  free(merge_joinable);
+
+  // The merged columns live in the scratch buffers
+  tmp = ll->locationID1;
+  ll->locationID1 = *scratch1;
+  *scratch1 = tmp;
+
+  tmp = ll->locationID2;
+  ll->locationID2 = *scratch2;
+  *scratch2 = tmp;
+
+  ll->capacity = n + 1;
+
+  return EXIT_SUCCESS;
+}
+
+/*
+ * Sorts both ID columns and computes the sum of distances between them for
+ * Part 1. With threads > 1 this is done by sort_locations_fused(), else the
+ * columns are radix sorted one after the other and l1_error() is used. The
+ * wall time is printed.
+ */
+ErrorCode
+sort_locations(LocationPairList ll, unsigned int threads, unsigned long long *distance)
+{
+  ErrorCode status = EXIT_SUCCESS;
+  struct timespec start, stop;
+  const size_t n = ll->n_locations;
+
+  // The serial path shares one scratch buffer between both columns, only
+  // the fused path needs one per column.
+  unsigned int *scratch1 = (unsigned int *)malloc( (n + 1) * sizeof(unsigned int) );
+  unsigned int *scratch2 = threads > 1 ? (unsigned int *)malloc( (n + 1) * sizeof(unsigned int) ) : NULL;
+  if (scratch1 == NULL || (threads > 1 && scratch2 == NULL))
+  {
+    perror("Failed to allocate sort buffer.\n");
+    free(scratch1);
+    free(scratch2);
+    return EXIT_FAILURE;
+  }
+
+  timespec_get(&start, TIME_UTC);
+
+  if (threads > 1)
+  {
+    status = sort_locations_fused(ll, &scratch1, &scratch2, threads, distance);
+  }
+  else
+  {
+    if (radix_sort(ll->locationID1, scratch1, n, RADIX_DIGIT_BITS) != EXIT_SUCCESS ||
+        radix_sort(ll->locationID2, scratch1, n, RADIX_DIGIT_BITS) != EXIT_SUCCESS)
+    {
+      status = EXIT_FAILURE;
+    }
+    else
+    {
+      *distance = l1_error(ll->locationID1, ll->locationID2, n);
+    }
+  }
+
+  timespec_get(&stop, TIME_UTC);
+
+  printf("Sort and distances: %.3f s (%u threads)\n",
+         (double)(stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1E9,
+         threads > 1 ? threads : 1);
+
+  free(scratch1);
+  free(scratch2);
+
+  return status;
+}
+
+
+/*
+ * Scores the left list of a location file against a saved frequency index.
+ * Neither list is sorted.
+ */
+ErrorCode
+query_frequency_index(const char *index_file, LocationPairList ll)
+{
+  FrequencyIndex index;
+  ErrorCode status;
+
+  if (FrequencyIndex_create(&index) != EXIT_SUCCESS)
+  {
+    return EXIT_FAILURE;
+  }
+
+  status = FrequencyIndex_load(index, index_file);
+  if (status == EXIT_SUCCESS)
+  {
+    printf("Part 2; Similarity score: %llu\n",
+           FrequencyIndex_similarity_score(index, ll->locationID1, ll->n_locations));
+  }
+
+  FrequencyIndex_destroy(&index);
+
+  return status;
+}
+
+/*
+ * Saves the frequency index of the sorted right list.
+ */
+ErrorCode
+save_frequency_index(const char *index_file, LocationPairList ll)
+{
+  FrequencyIndex index;
+  ErrorCode status;
+
+  if (FrequencyIndex_create(&index) != EXIT_SUCCESS)
+  {
+    return EXIT_FAILURE;
+  }
+
+  status = FrequencyIndex_build(index, ll->locationID2, ll->n_locations);
+  if (status == EXIT_SUCCESS)
+  {
+    status = FrequencyIndex_save(index, index_file);
+  }
+
+  FrequencyIndex_destroy(&index);
+
+  return status;
+}
+
+
+/*
+ * Usage: locations [-w <index> | -r <index>] <file> [threads]
+ *
+ * -w saves a frequency index of the right list after the run, -r only
+ * computes Part 2 for the left list of <file> against a saved index.
+ */
+int
+main(int argc, char **argv)
+{
+  const char *write_index = NULL;
+  const char *read_index = NULL;
+  int arg = 1;
+
+  while (arg + 1 < argc && argv[arg][0] == '-')
+  {
+    if (strcmp(argv[arg], "-w") == 0)
+    {
+      write_index = argv[arg+1];
+    }
+    else if (strcmp(argv[arg], "-r") == 0)
+    {
+      read_index = argv[arg+1];
+    }
+    else
+    {
+      fprintf(stderr, "Unknown option %s.\n", argv[arg]);
+      return EXIT_FAILURE;
+    }
+    arg += 2;
+  }
+
+  if (argc - arg < 1)
+  {
+    perror("Not enough input parameters.\n");
+    return EXIT_FAILURE;
+  }
+  else 
+  {
+    LocationPairList location_list;
+    unsigned int threads = argc - arg > 1 ? (unsigned int)strtoul(argv[arg+1], NULL, 10) : 1;
+
+    if (LocationPairList_create(&location_list) != EXIT_SUCCESS)
+    {
+      return EXIT_FAILURE;
+    }
+
+    // A query only needs the left list
+    if (LocationPairList_read_from_file(location_list, 
+                                        argv[arg], 
+                                        strlen(argv[arg]),
+                                        read_index != NULL ? 1 : 2) != EXIT_SUCCESS)
+    {
+      LocationPairList_destroy(&location_list);
+      return EXIT_FAILURE;
+    }
+
+    if (read_index != NULL)
+    {
+      ErrorCode status = query_frequency_index(read_index, location_list);
+
+      LocationPairList_destroy(&location_list);
+      return status;
+    }
 
     // Part 1
-    merge_sort((int*)location_list->locationID1, 
-               location_list->n_locations);
+    unsigned long long distance;
 
-    merge_sort((int*)location_list->locationID2, 
-               location_list->n_locations);
+    if (sort_locations(location_list, threads, &distance) != EXIT_SUCCESS)
+    {
+      LocationPairList_destroy(&location_list);
+      return EXIT_FAILURE;
+    }
 
-    printf("Part 1; Sum of distances: %d\n",
-           l1_error((int*)location_list->locationID1, 
-                   (int*)location_list->locationID2,
-                   location_list->n_locations));
+    printf("Part 1; Sum of distances: %llu\n", distance);
   
     // Part 2
-    printf("Part 2; Similarity score: %d\n", 
+    printf("Part 2; Similarity score: %llu\n", 
            similarity_socre(location_list->locationID1, 
                             location_list->locationID2, 
                             location_list->n_locations));
 
+    if (write_index != NULL &&
+        save_frequency_index(write_index, location_list) != EXIT_SUCCESS)
+    {
+      LocationPairList_destroy(&location_list);
+      return EXIT_FAILURE;
+    }
+
     LocationPairList_destroy(&location_list);
   }
 
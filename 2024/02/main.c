@@ -1,12 +1,11 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <stdbool.h>
 #include <string.h>
 
-const unsigned int MAX_LINE_LENGTH = 1024;
-const unsigned int MAX_REPORTS = 1E4;
-
 #define REPORT_SIZE 5
 
 typedef unsigned int ErrorCode;
@@ -34,6 +33,7 @@ Reports_destroy(Reports *reports)
   if ( (*reports)->allocated )
   {
     free( (*reports)->reports );
+    free( (*reports)->report_start_p );
   }
   free( (*reports) );
 
@@ -75,23 +75,17 @@ Reports_read_from_file(Reports reports, const char *filename, const unsigned int
   else 
   {
     printf("Reading reports from file %s\n", filename);
-    char buf[MAX_LINE_LENGTH];
+    char *buf = NULL;
+    size_t buf_capacity = 0;
 
     // Phase 1: Count number of reports
     reports->n_reports = 0;
-    while (fgets(buf, MAX_LINE_LENGTH, fp) != NULL)
+    while (getline(&buf, &buf_capacity, fp) != -1)
     {
       reports->n_reports++;
-
-      // Prevent runaway code
-      if (reports->n_reports > MAX_REPORTS)
-      {
-        printf("To many reports in file. File exceeds %d lines.\n", MAX_REPORTS);
-        return EXIT_FAILURE;
-      }
     }
 
-    printf("Number of reports: %d\n", reports->n_reports);
+    printf("Number of reports: %u\n", reports->n_reports);
 
     reports->report_start_p = (size_t *)malloc( (reports->n_reports + 1) * sizeof(size_t) );
 
@@ -101,7 +95,8 @@ Reports_read_from_file(Reports reports, const char *filename, const unsigned int
     reports->report_start_p[0] = 0;
     for (size_t i = 0; i < reports->n_reports; ++i)
     {
-      if (fgets(buf, MAX_LINE_LENGTH, fp) != NULL)
+      reports->report_start_p[i+1] = reports->report_start_p[i];
+      if (getline(&buf, &buf_capacity, fp) != -1)
       {
         size_t offset = 0;
         char *level_entry = strtok(buf, " ");
@@ -111,7 +106,7 @@ Reports_read_from_file(Reports reports, const char *filename, const unsigned int
           level_entry = strtok(NULL, " ");
         }
 
-        reports->report_start_p[i+1] = reports->report_start_p[i] + offset;
+        reports->report_start_p[i+1] += offset;
       }
     }
 
@@ -123,17 +118,18 @@ Reports_read_from_file(Reports reports, const char *filename, const unsigned int
     // Phase 3: Get report entries
     for (size_t i = 0; i < reports->n_reports; ++i)
     {
-      if (fgets(buf, MAX_LINE_LENGTH, fp) != NULL)
+      if (getline(&buf, &buf_capacity, fp) != -1)
       {
         char *level_entry = strtok(buf, " ");
         for (size_t j = reports->report_start_p[i]; j < reports->report_start_p[i+1]; ++j)
         {
-          sscanf(level_entry, "%d", &reports->reports[j]);
+          sscanf(level_entry, "%u", &reports->reports[j]);
           level_entry = strtok(NULL, " "); 
         }
       }
     }
 
+    free(buf);
     fclose(fp);
   }
 
@@ -142,46 +138,54 @@ Reports_read_from_file(Reports reports, const char *filename, const unsigned int
 }
 
 
+/* Function checking the rules for a report of length report_size with the
+ * level at position skip left out (skip >= report_size keeps all levels).
+ * See the README.md of this tasks for details on the rules. The direction
+ * is set by the first pair of levels, every later pair has to follow it.
+ *
+ * Return: The position of the first level of the first pair that breaks
+ * the rules, or report_size if the report is safe.
+ */
+size_t
+first_violation(const unsigned int *report, const size_t report_size, const size_t skip)
+{
+  size_t prev = skip == 0 ? 1 : 0;
+  long long direction = 0;
+
+  for (size_t j = prev + 1; j < report_size; ++j)
+  {
+    if (j == skip)
+    {
+      continue;
+    }
+
+    long long diff = (long long)report[j] - (long long)report[prev];
+
+    if (direction == 0)
+    {
+      direction = diff > 0 ? 1 : -1;
+    }
+
+    if (diff * direction < 1 || diff * direction > 3)
+    {
+      return prev;
+    }
+
+    prev = j;
+  }
+
+  return report_size;
+}
+
+
 /* Function checking the rules for a report of length report_size.
- * See the README.md of this tasks for details on the rules.
  *
  * Return: true if a report and false if a report is unsafe.
  */
 _Bool
 check_rules(const unsigned int *report, const unsigned int report_size)
 {
-    _Bool is_safe = true;
-    _Bool all_levels_increasing = true;
-    _Bool all_levels_decreasing = true;
-  
-    for (size_t j = 0; j < report_size - 1; ++j)
-    {
-      int diff = report[j+1] - report[j];
-  
-      if (diff > 0)
-      {
-        all_levels_decreasing = false;
-      }
-  
-      if (diff < 0)
-      {
-        all_levels_increasing = false;
-      }
-  
-      if (!all_levels_increasing && !all_levels_decreasing)
-      {
-        is_safe = false;
-        break;
-      }
-  
-      if (abs(diff) < 1 || abs(diff) > 3)
-      {
-        is_safe = false;
-        break;
-      }
-    }
-
-    return is_safe;
+  return first_violation(report, report_size, report_size) == report_size;
 }
 
 
@@ -209,14 +213,16 @@ Reports_safe_reports_count(Reports reports)
 }
 
 
-/* The function for part first checks if a report is safe, see 
+/* The function for part two first checks if a report is safe, see 
  * Reports_safe_reports_count().
- * Return: The number of reports + the number of reduced reports
- * for which the rules in check in check_ruls() applay.
+ * Return: The number of reports that are safe or become safe when a single
+ * level is removed.
  *
- * If a report initially is considered unsafe the rules are checkd
- * for a set of reduced reports. The reduced reports are constructed
- * by successively removing a single level entry.
+ * Only the levels around the first violation at pair (j, j+1) can fix a
+ * report: removing a level before j-1 or after j+1 leaves that pair and the
+ * direction set before it unchanged. So at most the three removals j-1, j
+ * and j+1 are checked, in place by skipping the level, which makes the
+ * check linear in the report size.
  */
 size_t
 Reports_damped_safe_reports_count(Reports reports)
@@ -226,51 +232,23 @@ Reports_damped_safe_reports_count(Reports reports)
   for (size_t i = 0; i < reports->n_reports; ++i)
   {
     const unsigned int *report_p = &reports->reports[reports->report_start_p[i]];
-    const unsigned int report_size = reports->report_start_p[i+1] - reports->report_start_p[i];
-
-    _Bool is_safe = check_rules(report_p, report_size);
+    const size_t report_size = reports->report_start_p[i+1] - reports->report_start_p[i];
 
-    // If the report is considered unsafe try to remove one of the levels to
-    // make it safe.
-    if (!is_safe)
-    {
+    const size_t j = first_violation(report_p, report_size, report_size);
 
-      // One after an other skip the level entries
-      for (size_t skip = 0; skip < report_size; ++skip)
-      {
-        //printf(" Dropping level %zu.\n", skip);
-        // Create a reduced report with the level at position 'skip'
-        // missing.
-        unsigned int reduced_report[report_size-1];
-
-        // Copy the level entries to the reduced report.
-        size_t k, j;
-        for (k = 0, j = 0; j < report_size; ++j)
-        {
-          if (j == skip)
-          {
-            continue;
-          }
-          else
-          {
-            reduced_report[k] = report_p[j];
-            ++k;
-          }
-        }
+    _Bool is_safe = j == report_size;
 
-        if (check_rules(reduced_report, report_size-1))
-        {
-          is_safe = true;
-          break;
-        }
-      }
+    // If the report is considered unsafe try to remove one of the levels
+    // around the violation to make it safe.
+    for (size_t skip = j > 0 ? j - 1 : 0; !is_safe && skip <= j + 1; ++skip)
+    {
+      is_safe = first_violation(report_p, report_size, skip) == report_size;
     }
 
     if (is_safe)
     {
       count++;
     }
-
   }
 
   return count;